@@ -0,0 +1,216 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <filesystem>
+#include <numeric>
+#include <algorithm>
+#include "jpg.h"
+
+// runs a fixed set of jobs on a few threads
+// the jobs are dealt out to the workers in turn and every worker works through its own queue from the front,
+// once that is empty it takes jobs from the back of the other queues, so no worker sits idle while there is work left
+class WorkStealingPool;
+
+// the name of the bmp that is written for filename
+std::string outputFilename(const std::string &filename);
+
+// decodes input file index of io and writes its bmp through io, everything it prints goes to console()
+// numThreads is passed on to decodeFused
+void decodeFile(BatchIO &io, const uint index, const std::string &filename, const bool strips, const uint numThreads, const IDCTMethod idctMethod, const byte scale);
+
+// decodes the files on up to numJobs threads, one file per thread, biggest files first so a big one doesnt end up running alone at the end
+// what a file prints is held back until the files before it are done, so the output comes out in the order the files were given
+// the files are read ahead and the bmps written in the background by one BatchIO the threads share
+void decodeBatch(const std::vector<std::string> &filenames, const uint numJobs, const bool strips, const IDCTMethod idctMethod, const byte scale);
+
+// Definitions
+
+class WorkStealingPool
+{
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> jobs;
+    };
+
+    std::vector<Queue> queues; // one per worker
+    std::vector<std::thread> workers;
+
+    // the next job for worker, false once there is none left anywhere (no jobs are added after the start)
+    bool take(const uint worker, std::function<void()> &job)
+    {
+        {
+            Queue &own = queues[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.jobs.empty())
+            {
+                job = std::move(own.jobs.front());
+                own.jobs.pop_front();
+                return true;
+            }
+        }
+        for (uint i = 1; i < queues.size(); i++)
+        {
+            Queue &victim = queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.jobs.empty())
+            {
+                job = std::move(victim.jobs.back());
+                victim.jobs.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(const uint worker)
+    {
+        std::function<void()> job;
+        while (take(worker, job))
+        {
+            job();
+        }
+    }
+
+public:
+    // deals out the jobs (in the order given) and starts the workers right away
+    WorkStealingPool(std::vector<std::function<void()>> &&jobs, const uint numWorkers)
+        : queues(std::max(1u, numWorkers))
+    {
+        for (std::size_t i = 0; i < jobs.size(); i++)
+        {
+            queues[i % queues.size()].jobs.push_back(std::move(jobs[i]));
+        }
+        for (uint i = 0; i < queues.size(); i++)
+        {
+            workers.emplace_back(&WorkStealingPool::run, this, i);
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    // waits for every job
+    ~WorkStealingPool()
+    {
+        for (std::thread &worker : workers)
+        {
+            worker.join();
+        }
+    }
+};
+
+std::string outputFilename(const std::string &filename)
+{
+    const std::size_t pos = filename.find_last_of('.');
+    return (pos == std::string::npos) ? (filename + ".bmp") : (filename.substr(0, pos) + ".bmp");
+}
+
+void decodeFile(BatchIO &io, const uint index, const std::string &filename, const bool strips, const uint numThreads, const IDCTMethod idctMethod, const byte scale)
+{
+    // every worker keeps its tables and buffers for the next file it decodes
+    thread_local Decoder decoder;
+    decoder.setIDCTMethod(idctMethod);
+    decoder.setScale(scale);
+    const std::shared_ptr<const std::vector<byte>> input = io.read(index);
+    if (input == nullptr)
+    {
+        console() << "ERROR: Error opening input file\n";
+        return;
+    }
+    Header *header = decoder.read(input->data(), input->size());
+    if (header == nullptr)
+    {
+        return;
+    }
+    if (header->valid == false)
+    {
+        console() << "Invalid JPG\n";
+        return;
+    }
+
+    printHeader(header);
+
+    const std::string outFilename = outputFilename(filename);
+    if (strips)
+    {
+        writeBMPStrips(header, outFilename);
+        return;
+    }
+
+    const std::shared_ptr<std::vector<byte>> bmp = decoder.output();
+    if (decoder.decodeBMP(*bmp, numThreads))
+    {
+        io.write(outFilename, bmp);
+    }
+}
+
+void decodeBatch(const std::vector<std::string> &filenames, const uint numJobs, const bool strips, const IDCTMethod idctMethod, const byte scale)
+{
+    // biggest files first (one that cant be looked at counts as empty, it will fail quickly anyway)
+    std::vector<std::uintmax_t> sizes(filenames.size());
+    for (uint i = 0; i < filenames.size(); i++)
+    {
+        std::error_code error;
+        sizes[i] = std::filesystem::file_size(filenames[i], error);
+        if (error)
+        {
+            sizes[i] = 0;
+        }
+    }
+    std::vector<uint> order(filenames.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&sizes](const uint a, const uint b)
+                     { return sizes[a] > sizes[b]; });
+
+    // BatchIO reads ahead in the order the files are started in
+    std::vector<std::string> ordered;
+    for (const uint index : order)
+    {
+        ordered.push_back(filenames[index]);
+    }
+    BatchIO io(ordered, std::max(batchPrefetch, numJobs));
+
+    std::vector<std::string> logs(filenames.size());
+    std::vector<bool> done(filenames.size(), false);
+    std::mutex mutex;
+    std::condition_variable finished;
+
+    // every file gets one thread, there are enough files to keep the cores busy
+    std::vector<std::function<void()>> jobs;
+    for (uint position = 0; position < order.size(); position++)
+    {
+        const uint index = order[position];
+        jobs.push_back([&, index, position]
+                       {
+            std::ostringstream log;
+            consoleStream() = &log;
+            decodeFile(io, position, filenames[index], strips, 1, idctMethod, scale);
+            consoleStream() = &std::cout;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            logs[index] = log.str();
+            done[index] = true;
+            finished.notify_all(); });
+    }
+    WorkStealingPool pool(std::move(jobs), std::min<std::size_t>(numJobs, filenames.size()));
+
+    // print every file as soon as it and the ones before it are done
+    for (uint i = 0; i < filenames.size(); i++)
+    {
+        std::string log;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.wait(lock, [&done, i]
+                          { return done[i]; });
+            log.swap(logs[i]);
+        }
+        std::cout << log << std::flush;
+    }
+}
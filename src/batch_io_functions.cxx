@@ -0,0 +1,611 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <new>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <string>
+#include <vector>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <cerrno>
+#define HAVE_IO_URING
+#endif
+#endif
+#include "jpg.h"
+
+// how many input files are read ahead of the one that is being decoded
+const uint batchPrefetch = 8;
+
+// reads the input files of a batch ahead of time and writes the output files in the background, so decoding never waits on the disk
+// uses io_uring where the kernel allows it, a few threads with blocking reads and writes otherwise
+// read, write and finish can be called from several threads (they take turns on the ring)
+class BatchIO;
+
+#ifdef HAVE_IO_URING
+// bare bones io_uring (talks to the kernel directly, no liburing needed)
+class IORing;
+#endif
+
+// Definitions
+
+#ifdef HAVE_IO_URING
+class IORing
+{
+private:
+    int fd = -1;
+    uint entries = 0;
+
+    void *sqMap = nullptr;
+    void *cqMap = nullptr;
+    std::size_t sqMapSize = 0;
+    std::size_t cqMapSize = 0;
+    io_uring_sqe *sqes = nullptr;
+
+    // the parts of the rings that are shared with the kernel
+    uint *sqHead = nullptr;
+    uint *sqTail = nullptr;
+    uint *sqMask = nullptr;
+    uint *sqArray = nullptr;
+    uint *cqHead = nullptr;
+    uint *cqTail = nullptr;
+    uint *cqMask = nullptr;
+    io_uring_cqe *cqes = nullptr;
+
+public:
+    IORing() = default;
+    IORing(const IORing &) = delete;
+    IORing &operator=(const IORing &) = delete;
+
+    ~IORing()
+    {
+        if (sqes != nullptr)
+            munmap(sqes, entries * sizeof(io_uring_sqe));
+        if (cqMap != nullptr && cqMap != sqMap)
+            munmap(cqMap, cqMapSize);
+        if (sqMap != nullptr)
+            munmap(sqMap, sqMapSize);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    // false if io_uring isnt available (old kernel, or blocked like in some containers)
+    bool setup(const uint size)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        fd = syscall(__NR_io_uring_setup, size, &params);
+        if (fd < 0)
+        {
+            return false;
+        }
+        entries = params.sq_entries;
+
+        sqMapSize = params.sq_off.array + params.sq_entries * sizeof(uint);
+        cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMap)
+        {
+            sqMapSize = cqMapSize = std::max(sqMapSize, cqMapSize);
+        }
+
+        sqMap = mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sqMap == MAP_FAILED)
+        {
+            sqMap = nullptr;
+            return false;
+        }
+        if (singleMap)
+        {
+            cqMap = sqMap;
+        }
+        else
+        {
+            cqMap = mmap(nullptr, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cqMap == MAP_FAILED)
+            {
+                cqMap = nullptr;
+                return false;
+            }
+        }
+        void *sqeMap = mmap(nullptr, entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqeMap == MAP_FAILED)
+        {
+            return false;
+        }
+        sqes = (io_uring_sqe *)sqeMap;
+
+        byte *const sq = (byte *)sqMap;
+        sqHead = (uint *)(sq + params.sq_off.head);
+        sqTail = (uint *)(sq + params.sq_off.tail);
+        sqMask = (uint *)(sq + params.sq_off.ring_mask);
+        sqArray = (uint *)(sq + params.sq_off.array);
+        byte *const cq = (byte *)cqMap;
+        cqHead = (uint *)(cq + params.cq_off.head);
+        cqTail = (uint *)(cq + params.cq_off.tail);
+        cqMask = (uint *)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // number of requests that can be in flight at once
+    uint size() const
+    {
+        return entries;
+    }
+
+    // queues one request and hands it to the kernel
+    // true means a completion will come for it, false means the kernel never saw it (so whatever entry points to can go)
+    bool submit(const io_uring_sqe &entry)
+    {
+        const uint tail = *sqTail;
+        if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= entries)
+        {
+            return false;
+        }
+        const uint slot = tail & *sqMask;
+        sqes[slot] = entry;
+        sqArray[slot] = slot;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+        while (syscall(__NR_io_uring_enter, fd, pending(), 0, 0, nullptr, 0) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            // the kernel is short of resources for now, the entry stays queued and goes out with the next enter
+            // (once it has been taken its completion will arrive anyway)
+            if (errno == EAGAIN || errno == EBUSY || __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) != tail)
+                return true;
+            // otherwise take it back out, or a later enter would hand the kernel a request that is gone by then
+            __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+            return false;
+        }
+        return true;
+    }
+
+    // entries queued that the kernel hasnt taken yet
+    uint pending() const
+    {
+        return *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    }
+
+    // takes the next completion, waiting for one if wait is set
+    bool complete(io_uring_cqe &entry, const bool wait)
+    {
+        while (true)
+        {
+            const uint head = *cqHead;
+            if (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+            {
+                entry = cqes[head & *cqMask];
+                __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+            if (!wait)
+            {
+                return false;
+            }
+            // entries a busy kernel didnt take before go out now
+            if (syscall(__NR_io_uring_enter, fd, pending(), 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                return false;
+            }
+        }
+    }
+};
+#endif
+
+class BatchIO
+{
+private:
+    enum FileState : byte
+    {
+        notQueued,
+        queued,
+        loaded,
+        failed
+    };
+
+    std::vector<std::string> filenames;
+    std::vector<std::shared_ptr<std::vector<byte>>> files; // contents of the input files that have been read but not handed out yet
+    std::vector<FileState> states;
+    uint prefetch;
+    uint nextQueued = 0;                  // first input file that hasnt been queued yet
+    std::vector<std::string> failedWrites; // reported (and cleared) from the calling thread
+    std::vector<std::shared_ptr<std::vector<byte>>> buffers; // every input buffer handed out so far, reused once the file has been decoded
+
+#ifdef HAVE_IO_URING
+    struct Request
+    {
+        int fd = -1;
+        uint index = 0;                                // input file being read, unused for writes
+        std::shared_ptr<std::vector<byte>> buffer;     // the file being read
+        std::shared_ptr<const std::vector<byte>> data; // the file being written
+        std::string filename;
+        std::size_t done = 0; // bytes transferred so far
+        iovec iov;
+    };
+
+    IORing ring;
+    bool useRing = false;
+    uint inFlight = 0;
+#endif
+
+    // thread fallback
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable changed;
+    uint pendingWrites = 0;
+    bool stopping = false;
+
+    // held by the thread that is using the ring or queueing reads, so several decoding threads can share one BatchIO
+    std::mutex callMutex;
+
+    // starts reading every file up to (not including) end
+    void queueReads(const uint end);
+
+    // a buffer of size bytes, made from one that nobody uses anymore if there is one
+    // nullptr if there isnt enough memory, so only that file fails (it is called on the I/O threads, where an exception would end the program)
+    std::shared_ptr<std::vector<byte>> takeBuffer(const std::size_t size);
+
+    // prints the writes that went wrong since the last call
+    void reportFailedWrites();
+
+#ifdef HAVE_IO_URING
+    void submit(Request *const request);
+    void handleCompletion(const io_uring_cqe &entry);
+    void finishRequest(Request *const request, const bool ok);
+#endif
+
+    void runWorker();
+
+public:
+    BatchIO(const std::vector<std::string> &inputs, const uint readAhead = batchPrefetch);
+    BatchIO(const BatchIO &) = delete;
+    BatchIO &operator=(const BatchIO &) = delete;
+    ~BatchIO();
+
+    // the contents of input file index (waits for it if needed), nullptr if it couldnt be read
+    // files should be asked for about in order (each file once), the next ones are read in the meantime
+    std::shared_ptr<const std::vector<byte>> read(const uint index);
+
+    // writes data to filename in the background
+    void write(const std::string &filename, const std::shared_ptr<const std::vector<byte>> &data);
+
+    // waits until everything has been written
+    void finish();
+};
+
+BatchIO::BatchIO(const std::vector<std::string> &inputs, const uint readAhead)
+    : filenames(inputs), files(inputs.size()), states(inputs.size(), notQueued), prefetch(std::max(1u, readAhead))
+{
+#ifdef HAVE_IO_URING
+    useRing = ring.setup(std::max(8u, prefetch * 2));
+    if (useRing)
+    {
+        return;
+    }
+#endif
+    // the threads spend most of their time waiting on the disk, so there can be more of them than cores
+    const uint numWorkers = std::min(prefetch, 4u);
+    for (uint i = 0; i < numWorkers; i++)
+    {
+        workers.emplace_back(&BatchIO::runWorker, this);
+    }
+}
+
+BatchIO::~BatchIO()
+{
+    finish();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void BatchIO::runWorker()
+{
+    while (true)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this]
+                         { return stopping || !jobs.empty(); });
+            if (jobs.empty())
+            {
+                return;
+            }
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        job();
+    }
+}
+
+void BatchIO::queueReads(const uint end)
+{
+    for (; nextQueued < end && nextQueued < filenames.size(); nextQueued++)
+    {
+        const uint index = nextQueued;
+
+#ifdef HAVE_IO_URING
+        if (useRing)
+        {
+            states[index] = queued;
+            const int fd = open(filenames[index].c_str(), O_RDONLY);
+            struct stat info;
+            if (fd < 0 || fstat(fd, &info) != 0)
+            {
+                if (fd >= 0)
+                    close(fd);
+                states[index] = failed;
+                continue;
+            }
+            Request *request = new Request;
+            request->fd = fd;
+            request->index = index;
+            request->buffer = takeBuffer(info.st_size);
+            if (request->buffer == nullptr)
+            {
+                close(fd);
+                delete request;
+                states[index] = failed;
+                continue;
+            }
+            submit(request);
+            continue;
+        }
+#endif
+
+        std::lock_guard<std::mutex> lock(mutex);
+        states[index] = queued;
+        jobs.push_back([this, index]
+                       {
+            std::shared_ptr<std::vector<byte>> buffer;
+            std::ifstream inFile = std::ifstream(filenames[index], std::ios::in | std::ios::binary | std::ios::ate);
+            // a directory or a pipe opens fine, but has no size
+            const std::streamoff size = inFile.is_open() ? (std::streamoff)inFile.tellg() : -1;
+            if (size >= 0)
+            {
+                buffer = takeBuffer((std::size_t)size);
+            }
+            if (buffer != nullptr)
+            {
+                inFile.seekg(0);
+                inFile.read((char *)buffer->data(), buffer->size());
+                if (!inFile)
+                    buffer.reset();
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            files[index] = buffer;
+            states[index] = buffer != nullptr ? loaded : failed;
+            changed.notify_all(); });
+        changed.notify_all();
+    }
+}
+
+std::shared_ptr<std::vector<byte>> BatchIO::takeBuffer(const std::size_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    try
+    {
+        for (const std::shared_ptr<std::vector<byte>> &buffer : buffers)
+        {
+            if (buffer.use_count() == 1)
+            {
+                // whoever let go of it last is done with the memory
+                std::atomic_thread_fence(std::memory_order_acquire);
+                buffer->resize(size);
+                return buffer;
+            }
+        }
+        buffers.push_back(std::make_shared<std::vector<byte>>(size));
+        return buffers.back();
+    }
+    catch (const std::bad_alloc &)
+    {
+        return nullptr;
+    }
+}
+
+std::shared_ptr<const std::vector<byte>> BatchIO::read(const uint index)
+{
+    std::unique_lock<std::mutex> call(callMutex);
+    queueReads(index + 1 + prefetch);
+
+#ifdef HAVE_IO_URING
+    if (useRing)
+    {
+        // pick up whatever has finished in the meantime, then wait for this file
+        io_uring_cqe entry;
+        while (ring.complete(entry, false))
+        {
+            handleCompletion(entry);
+        }
+        while (states[index] == queued && ring.complete(entry, true))
+        {
+            handleCompletion(entry);
+        }
+        reportFailedWrites();
+        std::shared_ptr<const std::vector<byte>> file = std::move(files[index]);
+        return states[index] == loaded ? file : nullptr;
+    }
+#endif
+
+    // the workers read the files, so others can go ahead meanwhile
+    call.unlock();
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this, index]
+                 { return states[index] != queued; });
+    std::shared_ptr<const std::vector<byte>> file = std::move(files[index]);
+    lock.unlock();
+    reportFailedWrites();
+    return file;
+}
+
+void BatchIO::write(const std::string &filename, const std::shared_ptr<const std::vector<byte>> &data)
+{
+#ifdef HAVE_IO_URING
+    if (useRing)
+    {
+        std::lock_guard<std::mutex> call(callMutex);
+        const int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            console() << "ERROR: Error opening output file\n";
+            return;
+        }
+        Request *request = new Request;
+        request->fd = fd;
+        request->data = data;
+        request->filename = filename;
+        submit(request);
+        return;
+    }
+#endif
+
+    std::lock_guard<std::mutex> lock(mutex);
+    pendingWrites += 1;
+    jobs.push_back([this, filename, data]
+                   {
+        std::ofstream outFile = std::ofstream(filename, std::ios::out | std::ios::binary);
+        outFile.write((const char *)data->data(), data->size());
+        const bool ok = outFile.is_open() && (bool)outFile;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!ok)
+            failedWrites.push_back(filename);
+        pendingWrites -= 1;
+        changed.notify_all(); });
+    changed.notify_all();
+}
+
+void BatchIO::finish()
+{
+#ifdef HAVE_IO_URING
+    if (useRing)
+    {
+        std::lock_guard<std::mutex> call(callMutex);
+        io_uring_cqe entry;
+        while (inFlight > 0 && ring.complete(entry, true))
+        {
+            handleCompletion(entry);
+        }
+        reportFailedWrites();
+        return;
+    }
+#endif
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this]
+                     { return pendingWrites == 0; });
+    }
+    reportFailedWrites();
+}
+
+void BatchIO::reportFailedWrites()
+{
+    std::vector<std::string> failures;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        failures.swap(failedWrites);
+    }
+    for (uint i = 0; i < failures.size(); i++)
+    {
+        console() << "ERROR: Error writing output file " << failures[i] << "\n";
+    }
+}
+
+#ifdef HAVE_IO_URING
+void BatchIO::submit(Request *const request)
+{
+    const std::size_t size = request->buffer != nullptr ? request->buffer->size() : request->data->size();
+    if (request->done == size)
+    {
+        finishRequest(request, true); // empty file, nothing to do
+        return;
+    }
+
+    // make room first, so the completion queue can never overflow
+    io_uring_cqe completion;
+    while (inFlight >= ring.size() && ring.complete(completion, true))
+    {
+        handleCompletion(completion);
+    }
+
+    io_uring_sqe entry;
+    std::memset(&entry, 0, sizeof(entry));
+    if (request->buffer != nullptr)
+    {
+        entry.opcode = IORING_OP_READV;
+        request->iov.iov_base = request->buffer->data() + request->done;
+    }
+    else
+    {
+        entry.opcode = IORING_OP_WRITEV;
+        request->iov.iov_base = (void *)(request->data->data() + request->done);
+    }
+    request->iov.iov_len = size - request->done;
+    entry.fd = request->fd;
+    entry.addr = (unsigned long)&request->iov;
+    entry.len = 1;
+    entry.off = request->done;
+    entry.user_data = (unsigned long)request;
+
+    if (!ring.submit(entry))
+    {
+        finishRequest(request, false); // the ring doesnt hold on to it, so it can go
+        return;
+    }
+    inFlight += 1;
+}
+
+void BatchIO::handleCompletion(const io_uring_cqe &entry)
+{
+    Request *const request = (Request *)entry.user_data;
+    inFlight -= 1;
+    if (entry.res == -EINTR || entry.res == -EAGAIN)
+    {
+        submit(request);
+        return;
+    }
+    if (entry.res <= 0)
+    {
+        finishRequest(request, false); // an error, or the file got shorter while we were reading it
+        return;
+    }
+    // reads and writes can stop short, then the rest is submitted again
+    request->done += entry.res;
+    submit(request);
+}
+
+void BatchIO::finishRequest(Request *const request, const bool ok)
+{
+    close(request->fd);
+    if (request->buffer != nullptr)
+    {
+        files[request->index] = ok ? request->buffer : nullptr;
+        states[request->index] = ok ? loaded : failed;
+    }
+    else if (!ok)
+    {
+        failedWrites.push_back(request->filename);
+    }
+    delete request;
+}
+#endif
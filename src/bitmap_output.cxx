@@ -4,83 +4,112 @@
 
 // declarations
 
-// writes all pixels in the MCUs to a BMP file
-void writeBMP(const Header *const header, const MCU *const mcus, const std::string &filename);
+// writes rows of RGB pixels (top row first, like YCbCrToRGB makes them) to a BMP file
+// the image has the decoded size, header->outputWidth() x header->outputHeight()
+void writeBMP(const Header *const header, const byte *const pixels, const std::string &filename);
+
+// builds the whole BMP file in memory (so it can be written out in one go, or in the background)
+void encodeBMP(const Header *const header, const byte *const pixels, std::vector<byte> &out);
+
+// sizes out for the whole BMP file and fills in its header, the pixel rows are left to the caller (bottom row first, padding already 0)
+void encodeBMPHeader(const Header *const header, std::vector<byte> &out);
+
+// appends the 26 byte BMP header for an image of the given size
+void putBMPHeader(std::vector<byte> &out, const uint width, const uint height);
 
 // helper function to write 4B int in little-endian
-void putInt(std::ofstream &outfile, const uint v);
+void putInt(std::vector<byte> &out, const uint v);
 
 // helper function to write 2B short int in little-endian
-void putShort(std::ofstream &outfile, const uint v);
+void putShort(std::vector<byte> &out, const uint v);
 
 // definitions
 
-void writeBMP(const Header *const header, const MCU *const mcus, const std::string &filename)
+void writeBMP(const Header *const header, const byte *const pixels, const std::string &filename)
 {
     // open the output file
     std::ofstream outFile = std::ofstream(filename, std::ios::out | std::ios::binary);
     if (!outFile.is_open())
     {
-        std::cout << "ERROR: Error opening output file\n";
+        console() << "ERROR: Error opening output file\n";
         return;
     }
 
-    // ceil(a/b) = (a + b - 1) / b
-    // const uint mcuHeight = (header->height + 7) / 8;
-    // const uint mcuWidth = (header->width + 7) / 8;
-    const uint paddingSize = header->width % 4;
-    const uint size = 14 + 12 + header->height * header->width * 3 + paddingSize * header->height;
-
-    // Header first part
-    outFile.put('B');
-    outFile.put('M');
-    putInt(outFile, size);
-    putInt(outFile, 0);
-    putInt(outFile, 0x1A);
+    std::vector<byte> bmp;
+    encodeBMP(header, pixels, bmp);
+    outFile.write((const char *)bmp.data(), bmp.size());
+    outFile.close();
+}
 
-    // DIB Header
-    putInt(outFile, 12);
-    putShort(outFile, header->width);
-    putShort(outFile, header->height);
-    putShort(outFile, 1);
-    putShort(outFile, 24);
+void encodeBMP(const Header *const header, const byte *const pixels, std::vector<byte> &out)
+{
+    encodeBMPHeader(header, out);
 
     // Rows into Header
-    for (int y = header->height - 1; y >= 0; y--)
+    const uint width = header->outputWidth();
+    const uint paddingSize = width % 4;
+    byte *pixel = out.data() + 14 + 12;
+    for (int y = header->outputHeight() - 1; y >= 0; y--)
     {
-        const uint mcuRow = y / 8;
-        const uint pixelRow = y % 8;
-        for (uint x = 0; x < header->width; x++)
+        const byte *in = pixels + (std::size_t)y * width * 3;
+        for (uint x = 0; x < width; x++)
         {
-            const uint mcuColumn = x / 8;
-            const uint pixelColumn = x % 8;
-            const uint mcuIndex = mcuRow * header->mcuWidthReal + mcuColumn;
-
-            const uint pixelIndex = pixelRow * 8 + pixelColumn;
-            outFile.put(mcus[mcuIndex].b[pixelIndex]);
-            outFile.put(mcus[mcuIndex].g[pixelIndex]);
-            outFile.put(mcus[mcuIndex].r[pixelIndex]);
+            *pixel++ = in[2];
+            *pixel++ = in[1];
+            *pixel++ = in[0];
+            in += 3;
         }
 
-        // writing padding bytes
-        for (uint i = 0; i < paddingSize; i++)
-        {
-            outFile.put(0);
-        }
+        // skipping the padding bytes
+        pixel += paddingSize;
     }
-    outFile.close();
 }
 
-void putInt(std::ofstream &outFile, const uint v)
+void encodeBMPHeader(const Header *const header, std::vector<byte> &out)
 {
-    outFile.put((v >> 0) & 0xFF);
-    outFile.put((v >> 8) & 0xFF);
-    outFile.put((v >> 16) & 0xFF);
-    outFile.put((v >> 24) & 0xFF);
+    const uint width = header->outputWidth();
+    const uint height = header->outputHeight();
+    const uint paddingSize = width % 4;
+    const uint size = 14 + 12 + height * width * 3 + paddingSize * height;
+    out.clear();
+    out.reserve(size);
+    putBMPHeader(out, width, height);
+    out.resize(size); // padding bytes stay 0
 }
 
-void putShort(std::ofstream &outFile, const uint v)
+void putBMPHeader(std::vector<byte> &out, const uint width, const uint height)
 {
-    outFile.put((v >> 0) & 0xFF);
-    outFile.put((v >> 8) & 0xFF);
-}
\ No newline at end of file
+    // ceil(a/b) = (a + b - 1) / b
+    // const uint mcuHeight = (header->height + 7) / 8;
+    // const uint mcuWidth = (header->width + 7) / 8;
+    const uint paddingSize = width % 4;
+    const uint size = 14 + 12 + height * width * 3 + paddingSize * height;
+
+    // Header first part
+    out.push_back('B');
+    out.push_back('M');
+    putInt(out, size);
+    putInt(out, 0);
+    putInt(out, 0x1A);
+
+    // DIB Header
+    putInt(out, 12);
+    putShort(out, width);
+    putShort(out, height);
+    putShort(out, 1);
+    putShort(out, 24);
+}
+
+void putInt(std::vector<byte> &out, const uint v)
+{
+    out.push_back((v >> 0) & 0xFF);
+    out.push_back((v >> 8) & 0xFF);
+    out.push_back((v >> 16) & 0xFF);
+    out.push_back((v >> 24) & 0xFF);
+}
+
+void putShort(std::vector<byte> &out, const uint v)
+{
+    out.push_back((v >> 0) & 0xFF);
+    out.push_back((v >> 8) & 0xFF);
+}
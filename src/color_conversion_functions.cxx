@@ -1,58 +1,125 @@
 #include <iostream>
+#include <algorithm>
 #include "jpg.h"
 
-void YCbCrToRGB(const Header *const header, MCU *const mcus);
+// converts every MCU of planes and writes the pixels as rows of interleaved RGB triples (top row first)
+// only the first rowCount rows are written and pixels past the right edge of the image are left out
+void YCbCrToRGB(const Header *const header, const BlockPlanes &planes, byte *const pixels, const uint rowCount);
 
-void YCbCrToRGBMCU(const Header *const header, MCU &mcu, const MCU &cbcr, const uint v, const uint h);
+// converts the MCU at mcuRow, mcuColumn of planes, pixels gets all (block size * horizontal sampling) x (block size * vertical sampling) of its RGB triples, row after row
+void YCbCrToRGBMCU(const Header *const header, const BlockPlanes &planes, const uint mcuRow, const uint mcuColumn, byte *const pixels);
 
-void YCbCrToRGBMCU(const Header *const header, MCU &mcu, const MCU &cbcr, const uint v, const uint h)
+// Definitions
+
+// like the float inverse DCT, the float conversion is kept free of FMA instructions,
+// so a -march=native build gives the same pixels as any other
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+void YCbCrToRGBMCU(const Header *const header, const BlockPlanes &planes, const uint mcuRow, const uint mcuColumn, byte *const pixels)
 {
-    for (uint y = 7; y < 8; --y)
+    // grayscale has no chroma planes, converting it with cb and cr at 0 gives every channel the luminance
+    static const int16_t noChroma[64] = {0};
+    const int16_t *cb = noChroma;
+    const int16_t *cr = noChroma;
+    if (planes.numComponents == 3)
+    {
+        cb = planes[1].block(planes[1].index(mcuRow, mcuColumn));
+        cr = planes[2].block(planes[2].index(mcuRow, mcuColumn));
+    }
+
+    const uint hs = header->horizontalSamplingFactor;
+    const uint vs = header->verticalSamplingFactor;
+    const uint size = header->blockSize();
+    const uint chromaSize = planes.numComponents == 3 ? header->blockSize(1) : size;
+    const BlockPlane &luma = planes[0];
+
+    // with the integer IDCT the whole decode is integer math, so the output doesnt depend on how the compiler treats floats
+    // the same factors as below, scaled by 2^16 and rounded
+    const bool fixedPoint = header->idctMethod == integerIDCT;
+    for (uint v = 0; v < vs; ++v)
     {
-        for (uint x = 7; x < 8; --x)
+        for (uint h = 0; h < hs; ++h)
         {
-            const uint pixel = y * 8 + x;
-            const uint cbcrPixelRow = y / header->verticalSamplingFactor + 4 * v;
-            const uint cbcrPixelColumn = x / header->horizontalSamplingFactor + 4 * h;
-            const uint cbcrPixel = cbcrPixelRow * 8 + cbcrPixelColumn;
-            int r = mcu.y[pixel] + 1.402f * cbcr.cr[cbcrPixel] + 128;
-            int g = mcu.y[pixel] - 0.344f * cbcr.cb[cbcrPixel] - 0.714f * cbcr.cr[cbcrPixel] + 128;
-            int b = mcu.y[pixel] + 1.772f * cbcr.cb[cbcrPixel] + 128;
-            if (r < 0)
-                r = 0;
-            if (r > 255)
-                r = 255;
-            if (g < 0)
-                g = 0;
-            if (g > 255)
-                g = 255;
-            if (b < 0)
-                b = 0;
-            if (b > 255)
-                b = 255;
-
-            mcu.r[pixel] = r;
-            mcu.g[pixel] = g;
-            mcu.b[pixel] = b;
+            const int16_t *const lum = luma.block(luma.index(mcuRow * vs + v, mcuColumn * hs + h));
+            for (uint y = 0; y < size; ++y)
+            {
+                byte *out = pixels + ((v * size + y) * hs * size + h * size) * 3;
+                for (uint x = 0; x < size; ++x)
+                {
+                    // the chroma blocks cover the whole MCU with chromaSize x chromaSize samples,
+                    // so with 2x2 sampling at full size each of their samples goes with 2x2 luma samples
+                    const uint pixel = y * 8 + x;
+                    const uint cbcrPixelRow = (v * size + y) * chromaSize / (vs * size);
+                    const uint cbcrPixelColumn = (h * size + x) * chromaSize / (hs * size);
+                    const uint cbcrPixel = cbcrPixelRow * 8 + cbcrPixelColumn;
+                    int r, g, b;
+                    if (fixedPoint)
+                    {
+                        r = lum[pixel] + ((91881 * cr[cbcrPixel] + 32768) >> 16) + 128;
+                        g = lum[pixel] + ((-22544 * cb[cbcrPixel] - 46793 * cr[cbcrPixel] + 32768) >> 16) + 128;
+                        b = lum[pixel] + ((116130 * cb[cbcrPixel] + 32768) >> 16) + 128;
+                    }
+                    else
+                    {
+                        r = lum[pixel] + 1.402f * cr[cbcrPixel] + 128;
+                        g = lum[pixel] - 0.344f * cb[cbcrPixel] - 0.714f * cr[cbcrPixel] + 128;
+                        b = lum[pixel] + 1.772f * cb[cbcrPixel] + 128;
+                    }
+                    if (r < 0)
+                        r = 0;
+                    if (r > 255)
+                        r = 255;
+                    if (g < 0)
+                        g = 0;
+                    if (g > 255)
+                        g = 255;
+                    if (b < 0)
+                        b = 0;
+                    if (b > 255)
+                        b = 255;
+
+                    *out++ = r;
+                    *out++ = g;
+                    *out++ = b;
+                }
+            }
         }
     }
 }
 
-void YCbCrToRGB(const Header *const header, MCU *const mcus)
+void YCbCrToRGB(const Header *const header, const BlockPlanes &planes, byte *const pixels, const uint rowCount)
 {
-    for (uint y = 0; y < header->mcuHeight; y += header->verticalSamplingFactor)
+    const uint mcuPixelWidth = header->horizontalSamplingFactor * header->blockSize();
+    const uint mcuPixelHeight = header->verticalSamplingFactor * header->blockSize();
+    const uint width = header->outputWidth();
+
+    // one MCU worth of pixels, 2x2 sampling makes the biggest one
+    byte mcuPixels[16 * 16 * 3];
+    for (uint mcuRow = 0; mcuRow < planes.mcuRows && mcuRow * mcuPixelHeight < rowCount; mcuRow++)
     {
-        for (uint x = 0; x < header->mcuWidth; x += header->horizontalSamplingFactor)
+        const uint top = mcuRow * mcuPixelHeight;
+        const uint rows = std::min(mcuPixelHeight, rowCount - top);
+        for (uint mcuColumn = 0; mcuColumn < planes.mcusPerRow && mcuColumn * mcuPixelWidth < width; mcuColumn++)
         {
-            const MCU &cbcr = mcus[y * header->mcuWidthReal + x];
-            for (uint v = header->verticalSamplingFactor - 1; v < header->verticalSamplingFactor; --v)
+            const uint left = mcuColumn * mcuPixelWidth;
+            const uint columns = std::min(mcuPixelWidth, width - left);
+            YCbCrToRGBMCU(header, planes, mcuRow, mcuColumn, mcuPixels);
+            for (uint row = 0; row < rows; row++)
             {
-                for (uint h = header->horizontalSamplingFactor - 1; h < header->horizontalSamplingFactor; --h)
-                {
-                    MCU &mcu = mcus[(y + v) * header->mcuWidthReal + (x + h)];
-                    YCbCrToRGBMCU(header, mcu, cbcr, v, h);
-                }
+                const byte *const in = mcuPixels + row * mcuPixelWidth * 3;
+                std::copy(in, in + columns * 3, pixels + ((std::size_t)(top + row) * width + left) * 3);
             }
         }
     }
-}
\ No newline at end of file
+}
+
+#if defined(__clang__)
+#pragma clang fp contract(on)
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
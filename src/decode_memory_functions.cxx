@@ -0,0 +1,30 @@
+#include <iostream>
+#include "jpg.h"
+
+// decodes a whole jpg that is already in memory, without going through the filesystem
+// the data is read in place, so it only has to stay alive until this returns
+DecodedImage decodeJPG(const byte *const data, const std::size_t size);
+
+// Definitions
+
+DecodedImage decodeJPG(const byte *const data, const std::size_t size)
+{
+    DecodedImage image;
+    image.header = readJPG(data, size);
+    if (image.header == nullptr || image.header->valid == false)
+    {
+        return image;
+    }
+
+    BlockPlanes *planes = decodeHuffmanData(image.header);
+    if (planes == nullptr)
+    {
+        return image;
+    }
+    inverseDCT(image.header, *planes);
+
+    image.pixels.resize((std::size_t)image.header->outputWidth() * image.header->outputHeight() * 3);
+    YCbCrToRGB(image.header, *planes, image.pixels.data(), image.header->outputHeight());
+    delete planes;
+    return image;
+}
@@ -2,10 +2,17 @@
 #include <fstream>
 #include "decoder_functions.cxx"
 #include "inverseDCT_functions.cxx"
-#include "dequantize_functions.cxx"
 #include "bitmap_output.cxx"
+#include "batch_io_functions.cxx"
 #include "huffman_functions.cxx"
 #include "color_conversion_functions.cxx"
+#include "fused_functions.cxx"
+#include "strip_functions.cxx"
+#include "decode_memory_functions.cxx"
+#include "incremental_functions.cxx"
+#include "reusable_decoder_functions.cxx"
+#include "probe_functions.cxx"
+#include "batch_decode_functions.cxx"
 #include "jpg.h"
 
 int main(int argc, char **argv)
@@ -16,11 +23,113 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    // once we make sure that a filename has been provided, we process every arg except the first one (first one is the code file)
-    for (int i = 1; i < argc; i++)
+    // --check-idct compares the SIMD inverse DCTs with the scalar ones on random blocks
+    if (std::string(argv[1]) == "--check-idct")
     {
-        const std::string filename(argv[i]); // store the filename as a string
-        Header *header = readJPG(filename); // reads the filename and returns a header that is constructed from reading the file
+        if (!checkInverseDCT(100000))
+        {
+            return 1;
+        }
+        std::cout << "IDCT ok\n";
+        return 0;
+    }
+
+    // options come before the filenames
+    // --probe only reads the SOF of every file and prints its size and sampling factors, one line per file (the other options dont matter then)
+    // --strips decodes one row of MCUs at a time and writes it out right away, so memory use doesnt grow with the height of the image
+    // -j N decodes up to N files at once (default: one per hardware thread)
+    // --integer-idct uses the fixed point inverse DCT, whose output is the same on every compiler and platform
+    // --scale N decodes the images at 1/N of their size, N is 1, 2, 4 or 8
+    bool probe = false;
+    bool strips = false;
+    IDCTMethod idctMethod = floatIDCT;
+    byte scale = 1;
+    uint numJobs = 0;
+    int first = 1;
+    for (; first < argc; first++)
+    {
+        const std::string arg(argv[first]);
+        if (arg == "--probe")
+        {
+            probe = true;
+        }
+        else if (arg == "--strips")
+        {
+            strips = true;
+        }
+        else if (arg == "--integer-idct")
+        {
+            idctMethod = integerIDCT;
+        }
+        else if (arg == "--scale")
+        {
+            const std::string value = first + 1 < argc ? argv[++first] : "";
+            if (value != "1" && value != "2" && value != "4" && value != "8")
+            {
+                std::cout << "error: invalid arguments\n";
+                return 1;
+            }
+            scale = value[0] - '0';
+        }
+        else if (arg.compare(0, 2, "-j") == 0)
+        {
+            const char *value = arg.size() > 2 ? argv[first] + 2 : (first + 1 < argc ? argv[++first] : "");
+            char *end = nullptr;
+            numJobs = std::strtoul(value, &end, 10);
+            if (*value == '\0' || *end != '\0')
+            {
+                std::cout << "error: invalid arguments\n";
+                return 1;
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (numJobs == 0)
+    {
+        numJobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // we process every arg after the options (the first one is the code file)
+    const std::vector<std::string> filenames(argv + first, argv + argc);
+
+    if (probe)
+    {
+        for (const std::string &filename : filenames)
+        {
+            ProbeInfo info;
+            probeJPG(filename, info);
+            printProbe(filename, info);
+        }
+        return 0;
+    }
+
+    if (numJobs > 1 && filenames.size() > 1)
+    {
+        decodeBatch(filenames, numJobs, strips, idctMethod, scale);
+        return 0;
+    }
+
+    // the next few files are read while the current one is decoded, and the bmps are written in the background
+    BatchIO io(filenames);
+
+    // the tables, coefficient and bmp buffers of one file are reused for the next
+    Decoder decoder;
+    decoder.setIDCTMethod(idctMethod);
+    decoder.setScale(scale);
+
+    for (uint i = 0; i < filenames.size(); i++)
+    {
+        const std::string &filename = filenames[i];
+        const std::shared_ptr<const std::vector<byte>> input = io.read(i);
+        if (input == nullptr)
+        {
+            std::cout << "ERROR: Error opening input file\n";
+            continue;
+        }
+        Header *header = decoder.read(input->data(), input->size()); // the decoder's header, filled in from the file
 
         if (header == nullptr)
         {
@@ -29,36 +138,27 @@ int main(int argc, char **argv)
         if (header->valid == false)
         {
             std::cout << "Invalid JPG\n";
-            delete header;
             continue;
         }
 
         printHeader(header);
 
-        // decode Huffman data
-        MCU *mcus = decodeHuffmanData(header);
-        if (mcus == nullptr)
+        const std::string outFilename = outputFilename(filename);
+        if (strips)
         {
-            delete header;
+            writeBMPStrips(header, outFilename);
             continue;
         }
 
-        // dequantize MCU coefficients
-        dequantize(header, mcus);
-
-        // inverse DCT on MCUs
-        inverseDCT(header, mcus);
-
-        // color conversion
-        YCbCrToRGB(header, mcus);
+        // decode Huffman data, dequantize, inverse DCT and color conversion, one MCU at a time straight into the bmp
+        std::shared_ptr<std::vector<byte>> bmp = decoder.output();
+        if (!decoder.decodeBMP(*bmp))
+        {
+            continue;
+        }
 
         // write bmp file
-        const std::size_t pos = filename.find_last_of('.');
-        const std::string outFilename = (pos == std::string::npos) ? (filename + ".bmp") : (filename.substr(0, pos) + ".bmp");
-        writeBMP(header, mcus, outFilename);
-
-        delete[] mcus;
-        delete header;
+        io.write(outFilename, bmp);
     }
 
     return 0;
@@ -1,65 +1,233 @@
 #include <iostream>
 #include <fstream>
+#include <cstring>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 #include "jpg.h"
 
 // Declarations
 
+// read cursor over a jpg in memory
+class ByteReader;
+
+// read only view of a whole file, memory mapped where the platform allows it
+class MappedFile;
+
 // read appn marker
-void readAPPN(std::ifstream &inFile, Header *const header);
+void readAPPN(ByteReader &reader, Header *const header);
 
 // read quantization table (DQT) marker
-void readQuantizationTable(std::ifstream &inFile, Header *const header);
+void readQuantizationTable(ByteReader &reader, Header *const header);
 
 // reads the jpg and calls other dub-readers
 Header *readJPG(const std::string &filename);
 
+// same as above, for a jpg that is already in memory
+Header *readJPG(const byte *const data, const std::size_t size);
+
+// same as the two above, but reads into an existing header (see Header::reset), false if the file couldnt be opened
+bool readJPG(const std::string &filename, Header *const header);
+void readJPG(const byte *const data, const std::size_t size, Header *const header);
+
+// reads every marker from SOI up to and including SOS, leaving the reader at the start of the compressed image data
+void readMarkers(ByteReader &reader, Header *const header);
+
+// checks that every color component only uses tables that have been defined
+void validateHeader(Header *const header);
+
 // reads start of frame
-void readStartOfFrame(std::ifstream &inFile, Header *const header);
+void readStartOfFrame(ByteReader &reader, Header *const header);
 
 // prints the content of header
 void printHeader(const Header *const header);
 
 // reads the Define Restart Interval (DRI) marker
-void readRestartInterval(std::ifstream &inFile, Header *const header);
+void readRestartInterval(ByteReader &reader, Header *const header);
 
 // reads the huffman tables
-void readHuffmanTable(std::ifstream &inFile, Header *const header);
+void readHuffmanTable(ByteReader &reader, Header *const header);
 
 // reads start of scan marker
-void readStartOfScan(std::ifstream &inFile, Header *const header);
+void readStartOfScan(ByteReader &reader, Header *const header);
 
 // reads a comment
-void readComment(std::ifstream &inFile, Header *const header);
+void readComment(ByteReader &reader, Header *const header);
+
+// returns the first 0xFF byte in [p, end), or end if there is none
+const byte *findMarkerByte(const byte *p, const byte *const end);
+
+// finds the end of the compressed image data and where its restart segments start, without copying it
+void readScanData(const byte *const data, const std::size_t size, Header *const header);
 
 // Definitions
 
-void readStartOfFrame(std::ifstream &inFile, Header *const header)
+class ByteReader
+{
+private:
+    const byte *data;
+    std::size_t size;
+    std::size_t pos = 0;
+    bool failed = false;
+
+public:
+    ByteReader(const byte *d, const std::size_t n)
+        : data(d), size(n)
+    {
+    }
+
+    // next byte, or 0 once we have run past the end (the reader then tests false, just like an ifstream)
+    byte get()
+    {
+        if (pos >= size)
+        {
+            failed = true;
+            return 0;
+        }
+        return data[pos++];
+    }
+
+    // jump over length bytes without looking at them
+    void skip(const std::size_t length)
+    {
+        if (length > size - pos)
+        {
+            pos = size;
+            failed = true;
+            return;
+        }
+        pos += length;
+    }
+
+    const byte *current() const
+    {
+        return data + pos;
+    }
+
+    std::size_t remaining() const
+    {
+        return size - pos;
+    }
+
+    explicit operator bool() const
+    {
+        return !failed;
+    }
+};
+
+class MappedFile
+{
+private:
+    const byte *bytes = nullptr;
+    std::size_t length = 0;
+#if defined(_WIN32)
+    std::vector<byte> buffer; // no mmap here, the file is read into memory instead
+#else
+    void *mapping = nullptr;
+#endif
+
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+#if !defined(_WIN32)
+        if (mapping != nullptr)
+            munmap(mapping, length);
+#endif
+    }
+
+    // sequential should be false when only a small part of the file is going to be read
+    bool open(const std::string &filename, const bool sequential = true)
+    {
+#if defined(_WIN32)
+        std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary | std::ios::ate);
+        if (!inFile.is_open())
+            return false;
+        buffer.resize((std::size_t)inFile.tellg());
+        inFile.seekg(0);
+        inFile.read((char *)buffer.data(), buffer.size());
+        bytes = buffer.data();
+        length = buffer.size();
+        return (bool)inFile;
+#else
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0)
+        {
+            close(fd);
+            return false;
+        }
+        length = info.st_size;
+        if (length == 0)
+        {
+            // cant map an empty file, leave it empty and let the parser complain
+            close(fd);
+            return true;
+        }
+        mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd); // the mapping stays valid after the descriptor is closed
+        if (mapping == MAP_FAILED)
+        {
+            mapping = nullptr;
+            length = 0;
+            return false;
+        }
+        // we read front to back, so let the kernel read ahead aggressively (or only page in what we touch)
+        madvise(mapping, length, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+        bytes = (const byte *)mapping;
+        return true;
+#endif
+    }
+
+    const byte *data() const
+    {
+        return bytes;
+    }
+
+    std::size_t size() const
+    {
+        return length;
+    }
+};
+
+void readStartOfFrame(ByteReader &reader, Header *const header)
 {
-    std::cout << "Reading SOF Marker\n";
+    console() << "Reading SOF Marker\n";
 
     if (header->numComponents != 0)
     {
-        std::cout << "ERROR: Multiple SOFs detected\n";
+        console() << "ERROR: Multiple SOFs detected\n";
         header->valid = false;
         return;
     }
 
-    uint length = (inFile.get() << 8) + inFile.get();
-    byte precision = inFile.get();
+    uint length = (reader.get() << 8) + reader.get();
+    byte precision = reader.get();
 
     if (precision != 8)
     {
-        std::cout << "ERROR: Invalid precision: " << (uint)precision << "\n";
+        console() << "ERROR: Invalid precision: " << (uint)precision << "\n";
         header->valid = false;
         return;
     }
 
-    header->height = (inFile.get() << 8) + inFile.get();
-    header->width = (inFile.get() << 8) + inFile.get();
+    header->height = (reader.get() << 8) + reader.get();
+    header->width = (reader.get() << 8) + reader.get();
 
     if (header->height == 0 || header->width == 0)
     {
-        std::cout << "ERROR: Invalid dimensions\n";
+        console() << "ERROR: Invalid dimensions\n";
         header->valid = false;
         return;
     }
@@ -68,23 +236,23 @@ void readStartOfFrame(std::ifstream &inFile, Header *const header)
     header->mcuHeightReal = header->mcuHeight;
     header->mcuWidthReal = header->mcuWidth;
 
-    header->numComponents = inFile.get();
+    header->numComponents = reader.get();
     if (header->numComponents == 4)
     {
-        std::cout << "ERROR: CMYK color mode not supported\n";
+        console() << "ERROR: CMYK color mode not supported\n";
         header->valid = false;
         return;
     }
     if (header->numComponents == 0)
     {
-        std::cout << "ERROR: Number of components musnt be zero\n";
+        console() << "ERROR: Number of components musnt be zero\n";
         header->valid = false;
         return;
     }
 
     for (uint i = 0; i < header->numComponents; i++)
     {
-        byte componentID = inFile.get();
+        byte componentID = reader.get();
         // Component ID's are usually 1, 2, 3 but rarely can be seen as 0, 1, 2
         // Always force them to 1, 2, 3 for consistency
         if (componentID == 0)
@@ -94,14 +262,14 @@ void readStartOfFrame(std::ifstream &inFile, Header *const header)
 
         if (componentID == 4 || componentID == 5)
         {
-            std::cout << "ERROR: YIQ color mode not supported\n";
+            console() << "ERROR: YIQ color mode not supported\n";
             header->valid = false;
             return;
         }
         // Generally component ID's are 1, 2, 3. But some JPEG's (like gorilla.jpg) use CID's starting from 0
         if (componentID == 0 || componentID > 3)
         {
-            std::cout << "Error:  Invalid component ID: " << (uint)componentID << "\n";
+            console() << "Error:  Invalid component ID: " << (uint)componentID << "\n";
             header->valid = false;
             return;
         }
@@ -110,18 +278,18 @@ void readStartOfFrame(std::ifstream &inFile, Header *const header)
 
         if (component->used)
         {
-            std::cout << "ERROR: Duplicate color component ID\n";
+            console() << "ERROR: Duplicate color component ID\n";
             header->valid = false;
             return;
         }
 
         component->used = true;
 
-        byte samplingFactor = inFile.get();
+        byte samplingFactor = reader.get();
         // Sampling factor is also split into upper and lower nibble
         component->horizontalSamplingFactor = samplingFactor >> 4; // upper nibble
         component->verticalSamplingFactor = samplingFactor & 0x0F; // lower nibble
-        component->quantizationTableID = inFile.get();
+        component->quantizationTableID = reader.get();
 
         if (componentID == 1)
         {
@@ -130,7 +298,7 @@ void readStartOfFrame(std::ifstream &inFile, Header *const header)
             // luminance channel
             if ((component->horizontalSamplingFactor != 1 && component->horizontalSamplingFactor != 2) || (component->verticalSamplingFactor != 1 && component->verticalSamplingFactor != 2))
             {
-                std::cout << "ERROR: Sampling factors not supported\n";
+                console() << "ERROR: Sampling factors not supported\n";
                 header->valid = false;
                 return;
             }
@@ -149,7 +317,7 @@ void readStartOfFrame(std::ifstream &inFile, Header *const header)
         {
             if (component->horizontalSamplingFactor != 1 || component->verticalSamplingFactor != 1)
             {
-                std::cout << "ERROR: Sampling factors not supported\n";
+                console() << "ERROR: Sampling factors not supported\n";
                 header->valid = false;
                 return;
             }
@@ -157,7 +325,7 @@ void readStartOfFrame(std::ifstream &inFile, Header *const header)
 
         if (component->quantizationTableID > 3)
         {
-            std::cout << "ERROR: Invalis quantization table id in frame components\n";
+            console() << "ERROR: Invalis quantization table id in frame components\n";
             header->valid = false;
             return;
         }
@@ -166,7 +334,7 @@ void readStartOfFrame(std::ifstream &inFile, Header *const header)
     // once we read all the color channels SOF shud ideally be over, but just to be sure
     if (length - 8 - (3 * header->numComponents) != 0)
     {
-        std::cout << "ERROR: SOF invalid\n";
+        console() << "ERROR: SOF invalid\n";
         header->valid = false;
         return;
     }
@@ -178,131 +346,128 @@ void printHeader(const Header *const header)
         return;
 
     // print the 4 quantization tables (how many exist)
-    std::cout << "\nDQT\n---\n";
+    console() << "\nDQT\n---\n";
     for (int i = 0; i < 4; i++) // all 4 quantization tables
     {
         if (header->quantizationTables[i].set)
         {
-            std::cout << "\nTable ID: " << i << "\n";
-            std::cout << "Table Data";
+            console() << "\nTable ID: " << i << "\n";
+            console() << "Table Data";
 
             for (uint j = 0; j < 64; j++)
             {
                 if (j % 8 == 0)
-                    std::cout << "\n";
+                    console() << "\n";
 
-                std::cout << header->quantizationTables[i].table[j] << "\t ";
+                console() << header->quantizationTables[i].table[j] << "\t ";
             }
-            std::cout << "\n";
+            console() << "\n";
         }
     }
 
-    std::cout << "\nStart of Frame\n--------------\n";
-    std::cout
+    console() << "\nStart of Frame\n--------------\n";
+    console()
         << "Frame type:\t0x" << std::hex << (uint)header->frameType << std::dec << "\n";
-    std::cout << "Height:\t\t" << header->height << "\n";
-    std::cout << "Width:\t\t" << header->width << "\n";
-    std::cout << "\nColor components\n";
+    console() << "Height:\t\t" << header->height << "\n";
+    console() << "Width:\t\t" << header->width << "\n";
+    console() << "\nColor components\n";
     for (uint i = 0; i < header->numComponents; i++)
     {
-        std::cout << "\nComponent ID:\t\t\t" << (i + 1) << "\n";
-        std::cout << "Horizontal Sampling Factor:\t" << (uint)header->colorComponents[i].horizontalSamplingFactor << "\n";
-        std::cout << "Vertical Sampling Factor:\t" << (uint)header->colorComponents[i].verticalSamplingFactor << "\n";
-        std::cout << "Quantization Table ID:\t\t" << (uint)header->colorComponents[i].quantizationTableID << "\n";
+        console() << "\nComponent ID:\t\t\t" << (i + 1) << "\n";
+        console() << "Horizontal Sampling Factor:\t" << (uint)header->colorComponents[i].horizontalSamplingFactor << "\n";
+        console() << "Vertical Sampling Factor:\t" << (uint)header->colorComponents[i].verticalSamplingFactor << "\n";
+        console() << "Quantization Table ID:\t\t" << (uint)header->colorComponents[i].quantizationTableID << "\n";
     }
 
     // Printing the Restart Interval
-    std::cout << "\nRestart Interval: " << header->restartInterval << "\n";
+    console() << "\nRestart Interval: " << header->restartInterval << "\n";
 
-    std::cout << "\nDefine Huffman Tables (DHT)\n---------------------------\n";
+    console() << "\nDefine Huffman Tables (DHT)\n---------------------------\n";
     // Printing DC Huffman Tables
-    std::cout << "DC Tables\n---------";
+    console() << "DC Tables\n---------";
     for (uint i = 0; i < 4; i++)
     {
         if (header->huffmanDCTables[i].set)
         {
-            std::cout << "\nTable ID: " << i << "\n";
-            std::cout << "Symbols\n";
+            console() << "\nTable ID: " << i << "\n";
+            console() << "Symbols\n";
             for (uint j = 0; j < 16; j++)
             {
-                std::cout << (j + 1) << ": ";
+                console() << (j + 1) << ": ";
                 for (uint k = header->huffmanDCTables[i].offset[j]; k < header->huffmanDCTables[i].offset[j + 1]; k++)
                 {
-                    std::cout << std::hex << (uint)header->huffmanDCTables[i].symbols[k] << std::dec << ' ';
+                    console() << std::hex << (uint)header->huffmanDCTables[i].symbols[k] << std::dec << ' ';
                 }
-                std::cout << "\n";
+                console() << "\n";
             }
         }
     }
 
     // Printing AC Huffman Tables
-    std::cout << "\n\nAC Tables\n---------";
+    console() << "\n\nAC Tables\n---------";
     for (uint i = 0; i < 4; i++)
     {
         if (header->huffmanACTables[i].set)
         {
-            std::cout << "\nTable ID: " << i << "\n";
-            std::cout << "Symbols\n";
+            console() << "\nTable ID: " << i << "\n";
+            console() << "Symbols\n";
             for (uint j = 0; j < 16; j++)
             {
-                std::cout << (j + 1) << ": ";
+                console() << (j + 1) << ": ";
                 for (uint k = header->huffmanACTables[i].offset[j]; k < header->huffmanACTables[i].offset[j + 1]; k++)
                 {
-                    std::cout << std::hex << (uint)header->huffmanACTables[i].symbols[k] << std::dec << ' ';
+                    console() << std::hex << (uint)header->huffmanACTables[i].symbols[k] << std::dec << ' ';
                 }
-                std::cout << "\n";
+                console() << "\n";
             }
         }
     }
-    std::cout << "\nStart of Selection\n------------------\n";
-    std::cout << "Start of Selection:\t\t" << (uint)header->startOfSelection << '\n';
-    std::cout << "End of Selection:\t\t" << std::dec << (uint)header->endOfSelection << '\n';
-    std::cout << "Successive Approximation High:\t" << (uint)header->successiveApproximationHigh << '\n';
-    std::cout << "Successive Approximation Low:\t" << (uint)header->successiveApproximationLow << '\n';
-    std::cout << "\nColor Components\n\n";
+    console() << "\nStart of Selection\n------------------\n";
+    console() << "Start of Selection:\t\t" << (uint)header->startOfSelection << '\n';
+    console() << "End of Selection:\t\t" << std::dec << (uint)header->endOfSelection << '\n';
+    console() << "Successive Approximation High:\t" << (uint)header->successiveApproximationHigh << '\n';
+    console() << "Successive Approximation Low:\t" << (uint)header->successiveApproximationLow << '\n';
+    console() << "\nColor Components\n\n";
     for (uint i = 0; i < header->numComponents; ++i)
     {
-        std ::cout << "Component ID:\t\t" << (i + 1) << '\n';
-        std ::cout << "Huffman DC Table ID:\t" << (uint)header->colorComponents[i].HuffmanDCTableID << '\n';
-        std::cout << "Huffman AC Table ID:\t" << (uint)header->colorComponents[i].HuffmanACTableID << '\n';
+        console() << "Component ID:\t\t" << (i + 1) << '\n';
+        console() << "Huffman DC Table ID:\t" << (uint)header->colorComponents[i].HuffmanDCTableID << '\n';
+        console() << "Huffman AC Table ID:\t" << (uint)header->colorComponents[i].HuffmanACTableID << '\n';
     }
-    std ::cout << "Length of Huffman Data:\t" << header->huffmanData.size() << '\n';
+    console() << "Length of Huffman Data:\t" << header->scanSize << '\n';
 
-    std::cout << "DRI=============\n";
-    std::cout << "Restart Interval: " << header->restartInterval << '\n';
+    console() << "DRI=============\n";
+    console() << "Restart Interval: " << header->restartInterval << '\n';
 }
 
-void readAPPN(std::ifstream &inFile, Header *const header)
+void readAPPN(ByteReader &reader, Header *const header)
 {
     // const just makes sure the header does not point to anything else, we can still make changes to its contents
-    std::cout << "Reading APPN Markers...\n";
-    uint length = (inFile.get() << 8) + inFile.get(); // we are reading 2 bytes from the length part (remember - FFXX LLLL), left shifting by 8 cuz, firs read byte goes in the Sig pos (BIG ENDIAN)
+    console() << "Reading APPN Markers...\n";
+    uint length = (reader.get() << 8) + reader.get(); // we are reading 2 bytes from the length part (remember - FFXX LLLL), left shifting by 8 cuz, firs read byte goes in the Sig pos (BIG ENDIAN)
 
-    for (uint i = 0; i < length - 2; i++) // -2 cuz we read the first 2
-        inFile.get();                     // we dont care about the APPN markers so we simply read them, this basically advances the position of the pointer
+    // we dont care about the APPN markers so we jump straight past them (-2 cuz we read the first 2)
+    // the bytes are never touched, so big EXIF/ICC blocks in a mapped file are never even paged in
+    reader.skip(length - 2);
 }
 
-void readComment(std::ifstream &inFile, Header *const header)
+void readComment(ByteReader &reader, Header *const header)
 {
-    std::cout << "Reading COM marker\n";
-    uint length = (inFile.get() << 8) + inFile.get();
-
-    for (uint i = 0; i < length - 2; i++)
-    {
-        inFile.get();
-    }
+    console() << "Reading COM marker\n";
+    uint length = (reader.get() << 8) + reader.get();
+    reader.skip(length - 2);
 }
 
-void readQuantizationTable(std::ifstream &inFile, Header *const header)
+void readQuantizationTable(ByteReader &reader, Header *const header)
 {
-    std::cout << "Reading DQT Markers...\n";
-    int length = (inFile.get() << 8) + inFile.get(); // NOTE: here length is not uint because we want to know if it goes below 0 for the while loop below
+    console() << "Reading DQT Markers...\n";
+    int length = (reader.get() << 8) + reader.get(); // NOTE: here length is not uint because we want to know if it goes below 0 for the while loop below
     length -= 2;
 
     // length is int not uint coz it can go negative in case of an error
     while (length > 0)
     {
-        byte tableInfo = inFile.get();
+        byte tableInfo = reader.get();
         length--;
 
         // table id is the lower nibble of tableInfo
@@ -311,7 +476,7 @@ void readQuantizationTable(std::ifstream &inFile, Header *const header)
         // jpeg permits max 4 quantization tables
         if (tableID > 3)
         {
-            std::cout << "ERROR: Invalid quantizaiton table ID: " << (uint)tableID << "\n";
+            console() << "ERROR: Invalid quantizaiton table ID: " << (uint)tableID << "\n";
             header->valid = false;
             return;
         }
@@ -324,117 +489,246 @@ void readQuantizationTable(std::ifstream &inFile, Header *const header)
         {
             // we are readnig 2 bytes here beacause since tableinfo is 1, we are reading a 16B quantization table
             for (uint i = 0; i < 64; i++)
-                header->quantizationTables[tableID].table[zigZagMap[i]] = (inFile.get() << 8) + inFile.get();
+                header->quantizationTables[tableID].table[zigZagMap[i]] = (reader.get() << 8) + reader.get();
             length -= 128; // 64 values * 16 bit
         }
         else
         {
             for (uint i = 0; i < 64; i++)
-                header->quantizationTables[tableID].table[zigZagMap[i]] = inFile.get();
+                header->quantizationTables[tableID].table[zigZagMap[i]] = reader.get();
             length -= 64;
         }
+
+        const float scales[8] = {s0, s1, s2, s3, s4, s5, s6, s7};
+        for (uint i = 0; i < 64; i++)
+            header->quantizationTables[tableID].prescaled[i] = header->quantizationTables[tableID].table[i] * scales[i / 8];
+        // 16 bit tables can go past what an int16 holds, the integer IDCT saturates every product anyway so capping them changes nothing
+        for (uint i = 0; i < 64; i++)
+            header->quantizationTables[tableID].table16[i] = (int16_t)std::min(header->quantizationTables[tableID].table[i], 32767u);
     }
 
     if (length != 0) // negative => didnt fit in properly
     {
-        std::cout << "ERROR: Invalid DQT\n";
+        console() << "ERROR: Invalid DQT\n";
         header->valid = false;
     }
 }
 
-void readRestartInterval(std::ifstream &inFile, Header *const header)
+void readRestartInterval(ByteReader &reader, Header *const header)
 {
-    std::cout << "Reading DRI marker...\n";
-    uint length = (inFile.get() << 8) + inFile.get();
+    console() << "Reading DRI marker...\n";
+    uint length = (reader.get() << 8) + reader.get();
 
     // setting the restart interval to the next 16bit integer
-    header->restartInterval = (inFile.get() << 8) + inFile.get();
+    header->restartInterval = (reader.get() << 8) + reader.get();
 
     // checking if the marker is valid
     if (length - 4 != 0) // subtracting 4 from the length since we read 4 bytes
     {
-        std::cout << "Error: DRI Invalid\n";
+        console() << "Error: DRI Invalid\n";
         header->valid = false;
     }
 }
 
+const byte *findMarkerByte(const byte *p, const byte *const end)
+{
+    // 0xFF bytes are rare in the compressed data, so compare 32 or 16 bytes at a time and only stop when one turns up
+#if defined(__AVX2__)
+    const __m256i ff32 = _mm256_set1_epi8((char)0xFF);
+    while (end - p >= 32)
+    {
+        const uint mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), ff32));
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i ff16 = _mm_set1_epi8((char)0xFF);
+    while (end - p >= 16)
+    {
+        const uint mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), ff16));
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p < end && *p != 0xFF)
+        p++;
+    return p;
+}
+
+void readScanData(const byte *const data, const std::size_t size, Header *const header)
+{
+    header->scanData = data;
+    header->restartOffsets.push_back(0);
+
+    std::size_t pos = 0;
+    while (true)
+    {
+        // everything up to the next 0xFF is plain data
+        pos = findMarkerByte(data + pos, data + size) - data;
+
+        if (pos + 1 >= size)
+        {
+            console() << "Error: File ended prematurely\n";
+            header->valid = false;
+            return;
+        }
+
+        const byte current = data[pos + 1];
+        // end of image
+        if (current == EOI)
+        {
+            header->scanSize = pos;
+            break;
+        }
+        // 0xFF00 is a stuffed 0xFF that belongs to the data
+        else if (current == 0x00)
+        {
+            pos += 2;
+        }
+        // restart marker
+        else if (current >= RST0 && current <= RST7)
+        {
+            // remember where the next segment starts so it can be decoded independently
+            pos += 2;
+            header->restartOffsets.push_back(pos);
+        }
+        // ignore multiple 0xFF's in a row
+        else if (current == 0xFF)
+        {
+            pos += 1;
+        }
+        else
+        {
+            console() << "Error: Invalid marker during compressed data scan. 0x" << std::hex << (uint)current << std::dec << "\n";
+            header->valid = false;
+            return;
+        }
+    }
+}
+
 Header *readJPG(const std::string &filename)
 {
-    // open file in binary
-    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary);
+    // std::nothrow returns a nullpointer if in case the allocation were to fail, avoids try-catch
+    Header *header = new (std::nothrow) Header;
 
-    // error handling
-    if (!inFile.is_open())
+    if (header == nullptr)
     {
-        std::cout << "ERROR: Error opening input file\n";
+        console() << "ERROR: Memory error\n";
         return nullptr;
     }
+    if (!readJPG(filename, header))
+    {
+        delete header;
+        return nullptr;
+    }
+    return header;
+}
 
-    // std::nothrow returns a nullpointer if in case the allocation were to fail, avoids try-catch
+Header *readJPG(const byte *const data, const std::size_t size)
+{
     Header *header = new (std::nothrow) Header;
 
     if (header == nullptr)
     {
-        std::cout << "ERROR: Memory error\n";
-        inFile.close();
+        console() << "ERROR: Memory error\n";
         return nullptr;
     }
+    readJPG(data, size, header);
+    return header;
+}
+
+bool readJPG(const std::string &filename, Header *const header)
+{
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+    if (!file->open(filename))
+    {
+        console() << "ERROR: Error opening input file\n";
+        return false;
+    }
+    // the huffman data is decoded straight out of the mapping, so the header keeps it alive
+    readJPG(file->data(), file->size(), header);
+    header->input = file;
+    return true;
+}
+
+void readJPG(const byte *const data, const std::size_t size, Header *const header)
+{
+    ByteReader reader(data, size);
+    header->reset();
 
+    readMarkers(reader, header);
+
+    // after SOS
+    if (header->valid)
+    {
+        // the rest of the file is the compressed image data (plus EOI)
+        readScanData(reader.current(), reader.remaining(), header);
+    }
+
+    // validate header info before returning
+    if (header->valid)
+    {
+        validateHeader(header);
+    }
+}
+
+void readMarkers(ByteReader &reader, Header *const header)
+{
     // READING THE FILE STARTS HERE
 
     // since markers are 2 bytes long we read 2 bytes at a time
-    byte last = inFile.get();
-    byte current = inFile.get();
+    byte last = reader.get();
+    byte current = reader.get();
 
     // Checking if the first 2 bytes in the JPEG are valid (remember how a marker looks -- FFXX)
     if (last != 0xFF || current != SOI)
     {
         header->valid = false;
-        inFile.close();
-        return header;
+        return;
     }
 
-    last = inFile.get();
-    current = inFile.get();
+    last = reader.get();
+    current = reader.get();
 
     // Read Markers
     while (header->valid) // we keep reading until we run out of markers or something else goes wrong
     {
         // check if we've reached past the end of the file
-        if (!inFile)
+        if (!reader)
         {
-            std::cout << "ERROR: File ended prematurely\n";
+            console() << "ERROR: File ended prematurely\n";
             header->valid = false;
-            inFile.close();
-            return header;
+            return;
         }
         // since we expect a marker at the beginning of each iteration of the loop
         if (last != 0xFF)
         {
-            std::cout << "ERROR: Expected a marker\n";
+            console() << "ERROR: Expected a marker\n";
             header->valid = false;
-            inFile.close();
-            return header;
+            return;
         }
 
         if (current == SOF0)
         {
             // read SOF marker
             header->frameType = SOF0;
-            readStartOfFrame(inFile, header);
+            readStartOfFrame(reader, header);
         }
         else if (current == DQT)
         {
             // read quantization table marker
-            readQuantizationTable(inFile, header);
+            readQuantizationTable(reader, header);
         }
         else if (current == DHT)
         {
-            readHuffmanTable(inFile, header);
+            readHuffmanTable(reader, header);
         }
         else if (current == SOS)
         {
-            readStartOfScan(inFile, header);
+            readStartOfScan(reader, header);
             // break from the while loop after SOS
             break;
         }
@@ -442,21 +736,21 @@ Header *readJPG(const std::string &filename)
         {
             // Test on: gorilla.jpg
             // Reads the restart interval marker (i.e. how often are the DC coefficients of the MCU's reset)
-            readRestartInterval(inFile, header);
+            readRestartInterval(reader, header);
         }
         else if (current >= APP0 && current <= APP15)
         {
             // read appn marker
-            readAPPN(inFile, header);
+            readAPPN(reader, header);
         }
         else if (current == COM) // comment
         {
-            readComment(inFile, header);
+            readComment(reader, header);
         }
         // following are some unused markers that can be skipped
         else if ((current >= JPG0 && current <= JPG11) || current == DNL || current == DHP || current == EXP)
         {
-            readComment(inFile, header);
+            readComment(reader, header);
         }
         else if (current == TEM)
         {
@@ -466,167 +760,98 @@ Header *readJPG(const std::string &filename)
         // any number of FF's are allowed and must be ignored
         else if (current == 0xFF)
         {
-            current = inFile.get();
+            current = reader.get();
             continue;
         }
         else if (current == SOI)
         {
-            std::cout << "Error: Embedded JPG's not supported\n";
+            console() << "Error: Embedded JPG's not supported\n";
             header->valid = false;
-            inFile.close();
-            return header;
+            return;
         }
         else if (current == EOI)
         {
-            std::cout << "Error: EOI detected before SOS\n";
+            console() << "Error: EOI detected before SOS\n";
             header->valid = false;
-            inFile.close();
-            return header;
+            return;
         }
         else if (current == DAC)
         {
-            std::cout << "Error: Arithmetic code not supported\n";
+            console() << "Error: Arithmetic code not supported\n";
             header->valid = false;
-            inFile.close();
-            return header;
+            return;
         }
         else if (current >= SOF0 && current <= SOF15)
         {
-            std::cout << "Error: SOF marker not supported: 0x" << std::hex << (uint)current << std::dec << "\n";
+            console() << "Error: SOF marker not supported: 0x" << std::hex << (uint)current << std::dec << "\n";
             header->valid = false;
-            inFile.close();
-            return header;
+            return;
         }
         else if (current >= RST0 && current <= RST7)
         {
-            std::cout << "Error: RSTN deteted before SOS\n";
+            console() << "Error: RSTN deteted before SOS\n";
             header->valid = false;
-            inFile.close();
-            return header;
+            return;
         }
         else
         {
-            std::cout << "Error: Unknown Marker: 0x" << std::hex << (uint)current << std::dec << "\n";
+            console() << "Error: Unknown Marker: 0x" << std::hex << (uint)current << std::dec << "\n";
             header->valid = false;
-            inFile.close();
-            return header;
+            return;
         }
 
-        last = inFile.get();
-        current = inFile.get();
-    }
-
-    // after SOS
-    if (header->valid)
-    {
-        current = inFile.get();
-        // read compressed image data
-        while (true)
-        {
-            if (!inFile)
-            {
-                std::cout << "Error: File ended prematurely\n";
-                header->valid = false;
-                inFile.close();
-                return header;
-            }
-
-            last = current;
-            current = inFile.get();
-
-            // if marker is found
-            if (last == 0xFF)
-            {
-                // end of image
-                if (current == EOI)
-                {
-                    break;
-                }
-                else if (current == 0x00)
-                {
-                    header->huffmanData.push_back(last);
-                    current = inFile.get();
-                }
-                // restart marker
-                else if (current >= RST0 && current <= RST7)
-                {
-                    current = inFile.get();
-                }
-                // ignore multiple 0xFF's in a row
-                else if (current == 0xFF)
-                {
-                    // do nothing
-                    continue;
-                }
-                else
-                {
-                    std::cout << "Error: Invalid marker during compressed data scan. 0x" << std::hex << (uint)current << std::dec << "\n";
-                    header->valid = false;
-                    inFile.close();
-                    return header;
-                }
-            }
-            else
-            {
-                // this is if last is nto equal to 0xFF
-                header->huffmanData.push_back(last);
-            }
-        }
+        last = reader.get();
+        current = reader.get();
     }
+}
 
-    // validate header info before returning
+void validateHeader(Header *const header)
+{
     if (header->numComponents != 1 && header->numComponents != 3)
     {
-        std ::cout << "Error - " << (uint)header->numComponents << " color components given (1 or 3 required)\n";
+        console() << "Error - " << (uint)header->numComponents << " color components given (1 or 3 required)\n";
         header->valid = false;
-        inFile.close();
-        return header;
+        return;
     }
 
     for (uint i = 0; i < header->numComponents; ++i)
     {
         if (header->quantizationTables[header->colorComponents[i].quantizationTableID].set == false)
         {
-            std::cout << "Error - Color component using uninitialized quantization table\n";
+            console() << "Error - Color component using uninitialized quantization table\n";
             header->valid = false;
-            inFile.close();
-            return header;
+            return;
         }
         if (header->huffmanDCTables[header->colorComponents[i].HuffmanDCTableID].set == false)
         {
-            std::cout << "Error - Color component using uninitialized Huffman DC table\n";
+            console() << "Error - Color component using uninitialized Huffman DC table\n";
             header->valid = false;
-            inFile.close();
-            return header;
+            return;
         }
         if (header->huffmanACTables[header->colorComponents[i].HuffmanACTableID].set == false)
         {
-            std::cout << "Error - Color component using uninitialized Huffman AC table\n";
+            console() << "Error - Color component using uninitialized Huffman AC table\n";
             header->valid = false;
-            inFile.close();
-            return header;
+            return;
         }
     }
-
-    inFile.close();
-    return header;
 }
 
-void readHuffmanTable(std::ifstream &inFile, Header *const header)
+void readHuffmanTable(ByteReader &reader, Header *const header)
 {
-    std::cout << "Reading DHT Marker...\n";
-    int length = (inFile.get() << 8) + inFile.get();
+    console() << "Reading DHT Marker...\n";
+    int length = (reader.get() << 8) + reader.get();
     length -= 2; // since we already read 2 bytes
 
     while (length > 0)
     {
-        byte tableInfo = inFile.get();
+        byte tableInfo = reader.get();
         byte tableID = tableInfo & 0x0F; // get the lower nibble
         bool ACTable = tableInfo >> 4;   // get the upper nibble
 
         if (tableID > 3)
         {
-            std::cout << "Error: Invalid Huffman Table with table ID: " << (uint)tableID << "\n";
+            console() << "Error: Invalid Huffman Table with table ID: " << (uint)tableID << "\n";
             header->valid = false;
             return;
         }
@@ -638,18 +863,20 @@ void readHuffmanTable(std::ifstream &inFile, Header *const header)
             hTable = &header->huffmanDCTables[tableID];
         hTable->set = true;
 
-        hTable->offset[0] = 0;
+        // read into a copy first, a header that is being reused may already hold (and have generated) the very same table
+        byte offset[17] = {0};
+        byte symbols[162];
         uint allSymbols = 0;
 
         for (uint i = 1; i <= 16; i++)
         {
-            allSymbols += inFile.get();
-            hTable->offset[i] = allSymbols;
+            allSymbols += reader.get();
+            offset[i] = allSymbols;
         }
 
         if (allSymbols > 162)
         {
-            std::cout << "Error: Too many symbols in the Huffman Table\n";
+            console() << "Error: Too many symbols in the Huffman Table\n";
             header->valid = false;
             return;
         }
@@ -657,31 +884,38 @@ void readHuffmanTable(std::ifstream &inFile, Header *const header)
         // reading the next chunk
         for (uint i = 0; i < allSymbols; i++)
         {
-            hTable->symbols[i] = inFile.get();
+            symbols[i] = reader.get();
+        }
+
+        if (std::memcmp(hTable->offset, offset, sizeof(offset)) != 0 || std::memcmp(hTable->symbols, symbols, allSymbols) != 0)
+        {
+            std::memcpy(hTable->offset, offset, sizeof(offset));
+            std::memcpy(hTable->symbols, symbols, allSymbols);
+            hTable->generated = false;
         }
 
         length -= 17 + allSymbols;
     }
     if (length != 0)
     {
-        std::cout << "Error: DHT Invalid\n";
+        console() << "Error: DHT Invalid\n";
         header->valid = false;
     }
 }
 
-void readStartOfScan(std::ifstream &inFile, Header *const header)
+void readStartOfScan(ByteReader &reader, Header *const header)
 {
-    std::cout << "Reading of Scan Marker...\n";
+    console() << "Reading of Scan Marker...\n";
     // We should not run into the SOS marker before reading the SOF marker
     // We can detect an error by checking if the number of components is still zero
     // It must be a non-zero value if we have gone through SOF marker before
     if (header->numComponents == 0)
     {
-        std::cout << "Error: SOS detected before SOF\n";
+        console() << "Error: SOS detected before SOF\n";
         header->valid = false;
         return;
     }
-    uint length = (inFile.get() << 8) + inFile.get();
+    uint length = (reader.get() << 8) + reader.get();
 
     // Setting all the used flags back to false coz we want to use them below
     for (uint i = 0; i < header->numComponents; i++)
@@ -689,16 +923,16 @@ void readStartOfScan(std::ifstream &inFile, Header *const header)
         header->colorComponents[i].used = false;
     }
 
-    byte numComponents = inFile.get();
+    byte numComponents = reader.get();
     for (uint i = 0; i < numComponents; i++)
     {
-        byte componentID = inFile.get();
+        byte componentID = reader.get();
         if (header->zeroBased)
             componentID += 1;
 
         if (componentID > header->numComponents)
         {
-            std::cout << "Error: Invalid color component ID: " << (uint)componentID << "\n";
+            console() << "Error: Invalid color component ID: " << (uint)componentID << "\n";
             header->valid = false;
             return;
         }
@@ -708,34 +942,34 @@ void readStartOfScan(std::ifstream &inFile, Header *const header)
         // if we run into a component whose used flag is true, this means we encountered this component twice in this loop
         if (component->used)
         {
-            std::cout << "Error: Duplicate color component ID: " << (uint)componentID << "\n";
+            console() << "Error: Duplicate color component ID: " << (uint)componentID << "\n";
             header->valid = false;
             return;
         }
         component->used = true;
 
         // reading the second byte which is the huffman table IDs
-        byte huffmanTableIDs = inFile.get();
+        byte huffmanTableIDs = reader.get();
         // upper nibble is the DC table ID
         component->HuffmanDCTableID = huffmanTableIDs >> 4;
         // lower nibble is the AC table ID
         component->HuffmanACTableID = huffmanTableIDs & 0x0F;
         if (component->HuffmanDCTableID > 3)
         {
-            std::cout << "Error: Invalid Huffman DC table ID: " << (uint)component->HuffmanDCTableID << "\n";
+            console() << "Error: Invalid Huffman DC table ID: " << (uint)component->HuffmanDCTableID << "\n";
             header->valid = false;
             return;
         }
         if (component->HuffmanACTableID > 3)
         {
-            std::cout << "Error: Invalid Huffman AC table ID: " << (uint)component->HuffmanACTableID << "\n";
+            console() << "Error: Invalid Huffman AC table ID: " << (uint)component->HuffmanACTableID << "\n";
             header->valid = false;
             return;
         }
     }
-    header->startOfSelection = inFile.get();
-    header->endOfSelection = inFile.get();
-    byte successiveApproximation = inFile.get();
+    header->startOfSelection = reader.get();
+    header->endOfSelection = reader.get();
+    byte successiveApproximation = reader.get();
     header->successiveApproximationHigh = successiveApproximation >> 4;
     header->successiveApproximationLow = successiveApproximation & 0x0F;
 
@@ -743,13 +977,13 @@ void readStartOfScan(std::ifstream &inFile, Header *const header)
     // Baseline JPGs don't use spectral selection and successive approximation
     if (header->startOfSelection != 0 || header->endOfSelection != 63)
     {
-        std::cout << "Error: Invalid spectral selection\n";
+        console() << "Error: Invalid spectral selection\n";
         header->valid = false;
         return;
     }
     if (header->successiveApproximationHigh != 0 || header->successiveApproximationLow != 0)
     {
-        std::cout << "Error: Invalid successive approximation\n";
+        console() << "Error: Invalid successive approximation\n";
         header->valid = false;
         return;
     }
@@ -757,7 +991,7 @@ void readStartOfScan(std::ifstream &inFile, Header *const header)
     // Verifying that the length we read is correct based on the number of bytes we read
     if (length - 6 - (2 * numComponents) != 0)
     {
-        std::cout << "Error SOS Invalid\n";
+        console() << "Error SOS Invalid\n";
         header->valid = false;
     }
 }
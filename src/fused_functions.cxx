@@ -0,0 +1,306 @@
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "jpg.h"
+
+// rows of MCUs the pipeline can hold per finishing thread, read but not finished yet
+const uint pipelineRowsPerThread = 2;
+
+// most threads the pipeline finishes rows on, finishing a row takes much less than reading it
+// so a few threads keep up with the reading thread, any more would only sit waiting for rows and hold slots
+const uint pipelineMaxFinishThreads = 3;
+
+// times a pipeline thread checks for what it waits on (yielding in between) before it goes to sleep until it is woken
+const uint pipelineSpins = 64;
+
+// decodes the image straight into a BMP file in memory (header included)
+// every MCU is dequantized, transformed and color converted right after it has been read, while it is still in cache,
+// instead of going over the whole image once for every step
+// restart segments are decoded on up to numThreads threads (0 means one per hardware thread)
+// the coefficient buffers come from arena if there is one, so they can be reused for the next image
+bool decodeFused(Header *const header, std::vector<byte> &bmp, uint numThreads = 0, DecodeArena *const arena = nullptr);
+
+// decodes MCUs start to end-1 from b and writes their pixels into BMP pixel rows
+// pixels starts with image row bottomRow, the rows above it follow (BMP rows are stored bottom up)
+bool decodeFusedRange(const Header *const header, BitReader &b, const uint start, const uint end, int *const previousDCs, byte *const pixels, const uint bottomRow);
+
+// dequantizes, transforms and color converts group (planes holding a single MCU) and writes it to BMP pixel rows like above
+// mcuRow and mcuColumn say where the MCU is in the image
+void finishMCU(const Header *const header, BlockPlanes &group, const uint mcuRow, const uint mcuColumn, byte *const pixels, const uint bottomRow);
+
+// for a scan that can only be read from start to end: this thread reads it row of MCUs by row of MCUs into a ring of row slots,
+// while numThreads-1 other threads (pipelineMaxFinishThreads at most) dequantize, transform, color convert and write every row as soon as it has been published
+// so with enough threads the whole thing takes about as long as reading the scan
+// slots is where the rows are kept
+bool decodePipelined(const Header *const header, byte *const pixels, const uint numThreads, BlockPlanes &slots);
+
+// dequantizes, transforms and color converts row planeRow of planes, which is row mcuRow of the image, and writes it to BMP pixel rows
+// (pixels starts with the bottom row of the image)
+void finishMCURow(const Header *const header, BlockPlanes &planes, const uint planeRow, const uint mcuRow, byte *const pixels);
+
+// writes the RGB pixels of one MCU (as YCbCrToRGBMCU makes them) to BMP pixel rows like above, leaving out what lies past the edges of the image
+void putMCUPixels(const Header *const header, const byte *const mcuPixels, const uint mcuRow, const uint mcuColumn, byte *const pixels, const uint bottomRow);
+
+// Definitions
+
+bool decodeFused(Header *const header, std::vector<byte> &bmp, uint numThreads, DecodeArena *const arena)
+{
+    // without an arena the buffers only live for this image
+    DecodeArena imageArena;
+    BlockPlanes &planes = arena != nullptr ? arena->planes : imageArena.planes;
+
+    const uint mcuCount = (header->mcuWidthReal / header->horizontalSamplingFactor) * (header->mcuHeightReal / header->verticalSamplingFactor);
+    if (numThreads == 0)
+    {
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    generateHuffmanTables(header);
+    encodeBMPHeader(header, bmp);
+    byte *const pixels = bmp.data() + 14 + 12;
+
+    // a big scan without restart markers is decoded speculatively, which keeps the blocks of every chunk (packed, see SpeculativeChunk) until their DCs are known
+    // after that every thread places one row of MCUs at a time into its own row of planes and finishes it, so the coefficients of the whole image are never needed
+    const uint numChunks = std::min<std::size_t>(numThreads, header->scanSize / speculativeChunkBytes);
+    if (header->restartInterval == 0 && numChunks > 1)
+    {
+        if (!planes.allocate(header, header->mcuWidthReal / header->horizontalSamplingFactor, numChunks))
+        {
+            console() << "Error: Memory error\n";
+            return false;
+        }
+        auto finishRow = [header, &planes, pixels](const uint row, const uint planeRow)
+        {
+            finishMCURow(header, planes, planeRow, row, pixels);
+        };
+        return decodeSpeculative(header, planes, mcuCount, numChunks, finishRow);
+    }
+
+    if (!hasRestartSegments(header, mcuCount))
+    {
+        if (numThreads > 1 && mcuCount > header->mcuWidthReal / header->horizontalSamplingFactor)
+        {
+            return decodePipelined(header, pixels, numThreads, planes);
+        }
+        BitReader b(header->scanData, header->scanSize);
+        int previousDCs[3] = {0};
+        return decodeFusedRange(header, b, 0, mcuCount, previousDCs, pixels, header->outputHeight() - 1);
+    }
+
+    // every segment writes to its own MCUs, so they dont get in each others way
+    auto decodeRange = [header, pixels](BitReader &b, const uint start, const uint end)
+    {
+        int previousDCs[3] = {0};
+        return decodeFusedRange(header, b, start, end, previousDCs, pixels, header->outputHeight() - 1);
+    };
+    return forEachRestartSegment(header, mcuCount, numThreads, decodeRange);
+}
+
+bool decodeFusedRange(const Header *const header, BitReader &b, const uint start, const uint end, int *const previousDCs, byte *const pixels, const uint bottomRow)
+{
+    const uint mcusPerRow = header->mcuWidthReal / header->horizontalSamplingFactor;
+
+    // the blocks of the MCU that is being decoded, kept for the next range this thread decodes
+    thread_local BlockPlanes group;
+    if (!group.allocate(header, 1, 1))
+    {
+        console() << "Error: Memory error\n";
+        return false;
+    }
+
+    for (uint m = start; m < end; m++)
+    {
+        if (header->restartInterval != 0 && m % header->restartInterval == 0)
+        {
+            previousDCs[0] = 0;
+            previousDCs[1] = 0;
+            previousDCs[2] = 0;
+
+            b.align();
+        }
+        if (!decodeMCUBlocks(header, b, group, 0, 0, previousDCs))
+        {
+            return false;
+        }
+        finishMCU(header, group, m / mcusPerRow, m % mcusPerRow, pixels, bottomRow);
+    }
+    return true;
+}
+
+bool decodePipelined(const Header *const header, byte *const pixels, const uint numThreads, BlockPlanes &slots)
+{
+    const uint mcusPerRow = header->mcuWidthReal / header->horizontalSamplingFactor;
+    const uint mcuRows = header->mcuHeightReal / header->verticalSamplingFactor;
+
+    const uint finishThreads = std::min(numThreads - 1, pipelineMaxFinishThreads);
+
+    // row r goes into slot r % slotCount
+    const uint slotCount = std::min(mcuRows, finishThreads * pipelineRowsPerThread);
+    std::unique_ptr<std::atomic<uint>[]> finished(new (std::nothrow) std::atomic<uint>[slotCount]); // rows that have been finished in each slot
+    if (!slots.allocate(header, mcusPerRow, slotCount) || finished == nullptr)
+    {
+        console() << "Error: Memory error\n";
+        return false;
+    }
+    for (uint i = 0; i < slotCount; i++)
+    {
+        finished[i] = 0;
+    }
+
+    // the ring itself needs no locks: the reading thread only ever publishes, the others claim rows with a counter
+    // and report back per slot, so the reading thread knows when it may reuse one
+    // a thread that has to wait spins a little and then sleeps on changed, which is signalled whenever a counter moves
+    std::atomic<uint> published(0);
+    std::atomic<uint> nextRow(0);
+    std::atomic<bool> failed(false);
+    std::mutex mutex;
+    std::condition_variable changed;
+    auto wait = [&](auto ready)
+    {
+        for (uint i = 0; i < pipelineSpins; i++)
+        {
+            if (ready())
+            {
+                return;
+            }
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, ready);
+    };
+    // taking the lock makes sure a thread that has just found ready() false is asleep before it is woken
+    auto signal = [&]()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+        }
+        changed.notify_all();
+    };
+    auto finishRows = [&]()
+    {
+        for (uint row = nextRow++; row < mcuRows; row = nextRow++)
+        {
+            wait([&]()
+                 { return published.load(std::memory_order_acquire) > row || failed; });
+            if (published.load(std::memory_order_acquire) <= row)
+            {
+                return;
+            }
+            finishMCURow(header, slots, row % slotCount, row, pixels);
+            finished[row % slotCount].fetch_add(1, std::memory_order_release);
+            signal();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (uint i = 0; i < finishThreads; i++)
+    {
+        threads.emplace_back(finishRows);
+    }
+
+    BitReader b(header->scanData, header->scanSize);
+    int previousDCs[3] = {0};
+    for (uint row = 0; row < mcuRows && !failed; row++)
+    {
+        // the slot is free once the row that was in it before has been finished
+        const uint slot = row % slotCount;
+        wait([&]()
+             { return finished[slot].load(std::memory_order_acquire) >= row / slotCount; });
+
+        for (uint x = 0; x < mcusPerRow; x++)
+        {
+            const uint m = row * mcusPerRow + x;
+            if (header->restartInterval != 0 && m % header->restartInterval == 0)
+            {
+                previousDCs[0] = 0;
+                previousDCs[1] = 0;
+                previousDCs[2] = 0;
+
+                b.align();
+            }
+            if (!decodeMCUBlocks(header, b, slots, slot, x, previousDCs))
+            {
+                failed = true;
+                break;
+            }
+        }
+        if (!failed)
+        {
+            published.store(row + 1, std::memory_order_release);
+        }
+        signal();
+    }
+
+    for (std::thread &t : threads)
+    {
+        t.join();
+    }
+    return !failed;
+}
+
+void finishMCURow(const Header *const header, BlockPlanes &planes, const uint planeRow, const uint mcuRow, byte *const pixels)
+{
+    for (uint i = 0; i < planes.numComponents; ++i)
+    {
+        const QuantizationTable &qTable = header->quantizationTables[header->colorComponents[i].quantizationTableID];
+        const uint blockRows = header->colorComponents[i].verticalSamplingFactor;
+        const std::size_t end = planes[i].index((planeRow + 1) * blockRows, 0);
+        for (std::size_t block = planes[i].index(planeRow * blockRows, 0); block < end; ++block)
+        {
+            inverseDCTBlock(qTable, planes[i].block(block), planes[i].lastNonZero[block], header->idctMethod, header->blockSize(i));
+        }
+    }
+
+    byte mcuPixels[16 * 16 * 3];
+    for (uint mcuColumn = 0; mcuColumn < planes.mcusPerRow; mcuColumn++)
+    {
+        YCbCrToRGBMCU(header, planes, planeRow, mcuColumn, mcuPixels);
+        putMCUPixels(header, mcuPixels, mcuRow, mcuColumn, pixels, header->outputHeight() - 1);
+    }
+}
+
+void finishMCU(const Header *const header, BlockPlanes &group, const uint mcuRow, const uint mcuColumn, byte *const pixels, const uint bottomRow)
+{
+    for (uint i = 0; i < group.numComponents; ++i)
+    {
+        const QuantizationTable &qTable = header->quantizationTables[header->colorComponents[i].quantizationTableID];
+        const std::size_t count = (std::size_t)group[i].blocksPerRow * group[i].blockRows;
+        for (std::size_t block = 0; block < count; ++block)
+        {
+            inverseDCTBlock(qTable, group[i].block(block), group[i].lastNonZero[block], header->idctMethod, header->blockSize(i));
+        }
+    }
+
+    byte mcuPixels[16 * 16 * 3];
+    YCbCrToRGBMCU(header, group, 0, 0, mcuPixels);
+    putMCUPixels(header, mcuPixels, mcuRow, mcuColumn, pixels, bottomRow);
+}
+
+void putMCUPixels(const Header *const header, const byte *const mcuPixels, const uint mcuRow, const uint mcuColumn, byte *const pixels, const uint bottomRow)
+{
+    const uint mcuPixelWidth = header->horizontalSamplingFactor * header->blockSize();
+    const uint mcuPixelHeight = header->verticalSamplingFactor * header->blockSize();
+    const uint width = header->outputWidth();
+    const uint left = mcuColumn * mcuPixelWidth;
+    const uint top = mcuRow * mcuPixelHeight;
+    const uint columns = std::min(mcuPixelWidth, width - left);
+    const uint rows = std::min(mcuPixelHeight, header->outputHeight() - top);
+
+    // BMP rows are stored bottom up, and as BGR
+    const std::size_t rowSize = width * 3 + width % 4;
+    for (uint row = 0; row < rows; row++)
+    {
+        const byte *in = mcuPixels + row * mcuPixelWidth * 3;
+        byte *out = pixels + (bottomRow - top - row) * rowSize + left * 3;
+        for (uint column = 0; column < columns; column++)
+        {
+            *out++ = in[2];
+            *out++ = in[1];
+            *out++ = in[0];
+            in += 3;
+        }
+    }
+}
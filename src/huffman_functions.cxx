@@ -1,20 +1,73 @@
 #include <iostream>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <functional>
 #include "jpg.h"
 
 class BitReader;
 
 byte getNextSymbol(BitReader &b, const HuffmanTable &hTable);
 
-bool decodeMCUComponent(BitReader &b, int *const component, int &previousDC, const HuffmanTable &dcTable, const HuffmanTable &acTable);
+// decodes one 8x8 block and records the zig-zag index of its last nonzero coefficient
+// reportErrors is turned off when a failure is expected (speculative decoding)
+bool decodeMCUComponent(BitReader &b, int16_t *const component, byte &lastNonZero, int &previousDC, const HuffmanTable &dcTable, const HuffmanTable &acTable, const bool reportErrors = true);
 
-// decode all the Huffman data and fill all MCUs
-MCU *decodeHuffmanData(Header *const header);
+// decode all the Huffman data into the block planes of the whole image (nullptr on failure, otherwise the caller deletes it)
+// restart segments are decoded on up to numThreads threads (0 means one per hardware thread)
+BlockPlanes *decodeHuffmanData(Header *const header, uint numThreads = 0);
+
+// same as above, into planes (whose memory is reused if it is big enough)
+bool decodeHuffmanData(Header *const header, BlockPlanes &planes, uint numThreads = 0);
+
+// decodes MCUs start to end-1 (counted in whole MCUs, left to right and top to bottom) from b
+bool decodeMCURange(const Header *const header, BlockPlanes &planes, BitReader &b, const uint start, const uint end);
+
+// decodes the blocks of the MCU at mcuRow, mcuColumn of planes
+bool decodeMCUBlocks(const Header *const header, BitReader &b, BlockPlanes &planes, const uint mcuRow, const uint mcuColumn, int *const previousDCs, const bool reportErrors = true);
+
+// true if the scan has exactly the restart markers DRI says it should, so every segment can be decoded on its own
+bool hasRestartSegments(const Header *const header, const uint mcuCount);
+
+// calls decodeRange(b, start, end) for every restart segment, on up to numThreads threads, and stops once one of them fails
+bool forEachRestartSegment(const Header *const header, const uint mcuCount, uint numThreads, const std::function<bool(BitReader &, uint, uint)> &decodeRange);
+
+// decodes a scan without restart markers by splitting it into numChunks chunks that are decoded in parallel from guessed positions
+// the blocks are then put into planes row of MCUs by row of MCUs on numChunks threads, into the rows of the image by default
+// with rowPlaced, thread t puts every row it takes into row t of planes instead (so planes needs only numChunks rows)
+// and calls rowPlaced(row, t) once it is there, so the row can be finished before the thread moves on
+bool decodeSpeculative(const Header *const header, BlockPlanes &planes, const uint mcuCount, const uint numChunks, const std::function<void(uint, uint)> &rowPlaced = nullptr);
+
+// generates the codes and lookup tables of every huffman table the header defines (unless they are already there)
+void generateHuffmanTables(Header *const header);
 
 // generates all the huffman codes from their frequencies
 void generateCodes(HuffmanTable &hTable);
 
+// fills the combined run/size/value table of an AC table (generateCodes must have run first)
+void generateACLookup(HuffmanTable &hTable);
+
 // Definitions
 
+void generateHuffmanTables(Header *const header)
+{
+    for (uint i = 0; i < 4; i++)
+    {
+        if (header->huffmanDCTables[i].set && !header->huffmanDCTables[i].generated)
+        {
+            generateCodes(header->huffmanDCTables[i]);
+            header->huffmanDCTables[i].generated = true;
+        }
+        if (header->huffmanACTables[i].set && !header->huffmanACTables[i].generated)
+        {
+            generateCodes(header->huffmanACTables[i]);
+            generateACLookup(header->huffmanACTables[i]);
+            header->huffmanACTables[i].generated = true;
+        }
+    }
+}
+
 void generateCodes(HuffmanTable &hTable)
 {
     uint code = 0; // 1 bit long code
@@ -27,92 +80,299 @@ void generateCodes(HuffmanTable &hTable)
         }
         code <<= 1; // left shift by 1, so a zero is appended to the right
     }
+
+    // fill the lookahead table, a code of length l owns every entry that starts with it
+    for (uint i = 0; i < (1 << huffmanLookaheadBits); i++)
+    {
+        hTable.lookupLength[i] = 0;
+        hTable.lookupSymbol[i] = 0;
+    }
+    for (uint i = 0; i < huffmanLookaheadBits; i++)
+    {
+        const uint length = i + 1;
+        for (uint j = hTable.offset[i]; j < hTable.offset[i + 1]; j++)
+        {
+            const uint first = hTable.codes[j] << (huffmanLookaheadBits - length);
+            const uint count = 1 << (huffmanLookaheadBits - length);
+            for (uint k = first; k < first + count && k < (1 << huffmanLookaheadBits); k++)
+            {
+                hTable.lookupLength[k] = length;
+                hTable.lookupSymbol[k] = hTable.symbols[j];
+            }
+        }
+    }
+
+    // canonical tables for the codes that dont fit in the lookahead
+    for (uint i = 0; i < 16; i++)
+    {
+        const uint length = i + 1;
+        if (hTable.offset[i] == hTable.offset[i + 1])
+        {
+            hTable.maxCode[length] = -1; // no codes of this length
+            hTable.valPtr[length] = 0;
+        }
+        else
+        {
+            hTable.valPtr[length] = hTable.offset[i] - (int)hTable.codes[hTable.offset[i]];
+            hTable.maxCode[length] = hTable.codes[hTable.offset[i + 1] - 1];
+        }
+    }
+}
+
+void generateACLookup(HuffmanTable &hTable)
+{
+    for (uint i = 0; i < (1 << huffmanLookaheadBits); i++)
+    {
+        hTable.acLookup[i] = 0;
+
+        const uint length = hTable.lookupLength[i];
+        if (length == 0)
+        {
+            continue; // long code, always takes the slow path
+        }
+        const byte symbol = hTable.lookupSymbol[i];
+        const uint numZeroes = symbol >> 4;
+        const uint coeffLength = symbol & 0x0F;
+
+        // EOB, skip 16 0's and invalid lengths are left to the slow path, as are coefficients whose bits dont fit
+        if (coeffLength == 0 || coeffLength > 10 || length + coeffLength > huffmanLookaheadBits)
+        {
+            continue;
+        }
+
+        int coeff = (i >> (huffmanLookaheadBits - length - coeffLength)) & ((1 << coeffLength) - 1);
+        if (coeff < (1 << (coeffLength - 1)))
+        {
+            coeff -= (1 << coeffLength) - 1;
+        }
+        hTable.acLookup[i] = (coeff * (1 << 16)) | (numZeroes << 8) | (length + coeffLength);
+    }
 }
 
-// helper class to read bits from a byte vector
+// helper class to read bits straight out of the huffman data in the file
+// 0xFF00 stuffing, fill bytes and restart markers are dropped while refilling, so the data is never copied
+// unread bits are kept left aligned in a 64 bit buffer that is refilled several bytes at a time
 class BitReader
 {
 private:
-    uint nextByte = 0;
-    uint nextBit = 0;
-    const std::vector<byte> &data;
+    const byte *data;
+    std::size_t size;
+    std::size_t nextByte = 0; // next byte to be loaded into the buffer
+    uint64_t buffer = 0;
+    uint bitCount = 0; // number of unread bits in the buffer
+    uint fillBits = 0; // how many of the bits loaded so far came from past the end of the data
+
+    // false for the bytes that only exist because of byte stuffing or markers
+    bool isDataByte(const std::size_t i) const
+    {
+        if (data[i] == 0xFF)
+        {
+            return i + 1 < size && data[i + 1] == 0x00; // anything else after a 0xFF makes it fill or a marker
+        }
+        if (i > 0 && data[i - 1] == 0xFF)
+        {
+            return false; // the 0x00 of a stuffed 0xFF or the second byte of a marker
+        }
+        return true;
+    }
+
+    // top the buffer up to more than 56 bits
+    void refill()
+    {
+        if (nextByte + 8 <= size)
+        {
+            // load 8 bytes at once (MSB first) and keep as many whole bytes as there is room for
+            uint64_t word = 0;
+            for (uint i = 0; i < 8; i++)
+            {
+                word = (word << 8) | data[nextByte + i];
+            }
+            // a 0xFF byte turns into a 0 byte in ~word, if there are none all 8 bytes are plain data
+            const uint64_t inverted = ~word;
+            if (((inverted - 0x0101010101010101ULL) & ~inverted & 0x8080808080808080ULL) == 0)
+            {
+                const uint bytes = (64 - bitCount) / 8;
+                if (bytes != 0)
+                {
+                    buffer |= (word >> (64 - bytes * 8)) << (64 - bitCount - bytes * 8);
+                    bitCount += bytes * 8;
+                    nextByte += bytes;
+                }
+                return;
+            }
+        }
+
+        // close to the end or to a 0xFF, go byte by byte and pad with 1s past the end (the same as the fill bits used by encoders)
+        while (bitCount <= 56)
+        {
+            uint64_t value = 0xFF;
+            if (nextByte < size)
+            {
+                value = data[nextByte];
+                nextByte += 1;
+                if (value == 0xFF)
+                {
+                    if (nextByte < size && data[nextByte] == 0x00)
+                    {
+                        nextByte += 1; // stuffed 0xFF, drop the 0x00
+                    }
+                    else
+                    {
+                        if (nextByte < size && data[nextByte] >= RST0 && data[nextByte] <= RST7)
+                        {
+                            nextByte += 1; // restart marker, the caller realigns
+                        }
+                        continue; // fill byte, or the start of a marker
+                    }
+                }
+            }
+            else
+            {
+                fillBits += 8;
+            }
+            buffer |= value << (56 - bitCount);
+            bitCount += 8;
+        }
+    }
 
 public:
-    BitReader(const std::vector<byte> &d)
-        : data(d) // using initalizer list to init d since we cant init a const in the body of a constructor
+    BitReader(const byte *d, const std::size_t n)
+        : data(d), size(n)
     {
     }
 
-    // read one bit (0 or 1) or return -1 if all bits have already been read
-    int readBit()
+    // starts reading at any bit of the data, position() still counts from the start of the data
+    // a start inside a byte that is not data (like the 0x00 of a stuffed 0xFF) moves on to the next data byte
+    BitReader(const byte *d, const std::size_t n, const std::size_t startBit)
+        : data(d), size(n), nextByte(std::min(startBit / 8, n))
     {
-        if (nextByte >= data.size())
-            return -1;
-        int bit = (data[nextByte] >> (7 - nextBit)) & 1; // we do 7 - to maintain a order of MSB to LSB of the read bits
-        nextBit += 1;
-        if (nextBit == 8)
+        if (nextByte < size && !isDataByte(nextByte))
+        {
+            while (nextByte < size && !isDataByte(nextByte))
+            {
+                nextByte += 1;
+            }
+            return;
+        }
+        skipBits(startBit % 8);
+    }
+
+    // look at the next length (1 to 32) bits without consuming them
+    // bits past the end of the data read as 1s
+    uint peekBits(const uint length)
+    {
+        if (bitCount < length)
         {
-            nextBit = 0;
-            nextByte += 1;
+            refill();
         }
-        return bit;
+        return buffer >> (64 - length);
+    }
+
+    // consume length bits, returns false if that runs past the end of the data
+    bool skipBits(const uint length)
+    {
+        if (bitCount < length)
+        {
+            refill();
+        }
+        buffer <<= length;
+        bitCount -= length;
+        return bitCount >= fillBits;
     }
 
     // read a varaible number of bits
     // first read bit is MSB
-    // return -1 if at any point all bits have already been read
-    int readBits(const uint length)
+    // return -1 if the bits run past the end of the data
+    int getBits(const uint length)
     {
-        int bits = 0;
-        for (uint i = 0; i < length; i++)
+        if (length == 0)
         {
-            int bit = readBit(); // to get the next bit out of the bitstream
-            if (bit == -1)
-            {
-                bits = -1;
-                break;
-            }
-            bits = (bits << 1) | bit; // add the read bit to the bitstream by ORing
+            return 0;
+        }
+        const int bits = peekBits(length);
+        if (!skipBits(length))
+        {
+            return -1;
         }
         return bits;
     }
 
-    void align()
+    // position of the next unread bit, counted in bits from the start of the data (stuffing included)
+    std::size_t position() const
     {
-        if (nextByte >= data.size())
+        if (fillBits > bitCount)
         {
-            return;
+            return size * 8 + fillBits - bitCount; // all of the data has already been read
+        }
+
+        // walk back over the data bytes that are still (partly) in the buffer
+        uint unread = bitCount - fillBits;
+        std::size_t i = nextByte;
+        while (unread > 0)
+        {
+            i -= 1;
+            if (isDataByte(i))
+            {
+                if (unread <= 8)
+                {
+                    return i * 8 + (8 - unread);
+                }
+                unread -= 8;
+            }
         }
-        if (nextBit != 0)
+
+        // the buffer is empty, so its the start of the next data byte
+        while (i < size && !isDataByte(i))
+        {
+            i += 1;
+        }
+        return i * 8;
+    }
+
+    // skip the rest of the current byte
+    void align()
+    {
+        if (bitCount <= fillBits)
         {
-            nextBit = 0;
-            nextByte += 1;
+            return; // all of the data has already been read
         }
+        buffer <<= bitCount % 8;
+        bitCount -= bitCount % 8;
     }
 };
 
 byte getNextSymbol(BitReader &b, const HuffmanTable &hTable)
 {
-    uint currentCode = 0;
-    for (uint i = 0; i < 16; i++)
+    // peek at the next few bits, most codes are short enough to be resolved right here
+    const uint lookahead = b.peekBits(huffmanLookaheadBits);
+    const uint length = hTable.lookupLength[lookahead];
+    if (length != 0)
     {
-        int bit = b.readBit();
-        if (bit == -1)
+        if (!b.skipBits(length))
         {
-            return -1; // since the return type is byte, which is char (0-255), when we return -1 it gets forced into the valid range and returns 255 instead
+            return -1; // the code ran past the end of the data
         }
-        currentCode = (currentCode << 1) | bit;
-        for (uint j = hTable.offset[i]; j < hTable.offset[i + 1]; j++)
+        return hTable.lookupSymbol[lookahead];
+    }
+
+    // the code is longer than the lookahead, try longer prefixes until one fits under the max code of its length
+    const uint bits = b.peekBits(16);
+    for (uint i = huffmanLookaheadBits + 1; i <= 16; i++)
+    {
+        const int currentCode = bits >> (16 - i);
+        if (currentCode <= hTable.maxCode[i])
         {
-            // j's are all the indices of all the codes of same length
-            if (currentCode == hTable.codes[j])
-                return hTable.symbols[j];
+            if (!b.skipBits(i))
+            {
+                return -1; // since the return type is byte, which is char (0-255), when we return -1 it gets forced into the valid range and returns 255 instead
+            }
+            return hTable.symbols[hTable.valPtr[i] + currentCode];
         }
     }
     return -1; // after reading 16 bits we never found a match
 }
 
-bool decodeMCUComponent(BitReader &b, int *const component, int &previousDC, const HuffmanTable &dcTable, const HuffmanTable &acTable)
+bool decodeMCUComponent(BitReader &b, int16_t *const component, byte &lastNonZero, int &previousDC, const HuffmanTable &dcTable, const HuffmanTable &acTable, const bool reportErrors)
 {
     // uses the dc and ac tables to extract the dc and ac coeffs
 
@@ -120,19 +380,22 @@ bool decodeMCUComponent(BitReader &b, int *const component, int &previousDC, con
     byte length = getNextSymbol(b, dcTable);
     if (length == (byte)-1)
     {
-        std::cout << "Error: Invalid DC value?\n";
+        if (reportErrors)
+            console() << "Error: Invalid DC value?\n";
         return false;
     }
     if (length > 11) // we know that DC coeff shud never have a length > 11
     {
-        std::cout << "Error: DC coefficient length greater than 11\n";
+        if (reportErrors)
+            console() << "Error: DC coefficient length greater than 11\n";
         return false;
     }
 
-    int coeff = b.readBits(length);
+    int coeff = b.getBits(length);
     if (coeff == -1)
     {
-        std::cout << "Error: Invalid DC value\n";
+        if (reportErrors)
+            console() << "Error: Invalid DC value\n";
         return false;
     }
 
@@ -143,17 +406,46 @@ bool decodeMCUComponent(BitReader &b, int *const component, int &previousDC, con
     }
 
     // this part makes sure that DC coeffs are relative to the DC coeff of the prev MCU
-    component[0] = coeff + previousDC;
-    previousDC = component[0];
+    previousDC += coeff;
+    component[0] = previousDC;
 
     // get the AC values for this MCU component
+    lastNonZero = 0;
     uint i = 1;
     while (i < 64)
     {
+        // fast path, the code and the coefficient bits were both in the lookahead
+        const int fast = acTable.acLookup[b.peekBits(huffmanLookaheadBits)];
+        if (fast != 0)
+        {
+            const uint numZeroes = (fast >> 8) & 0xFF;
+            if (i + numZeroes >= 64)
+            {
+                if (reportErrors)
+                    console() << "Error: Zero run-length exceeded MCU\n";
+                return false;
+            }
+            if (!b.skipBits(fast & 0xFF))
+            {
+                if (reportErrors)
+                    console() << "Error: Invalid AC value\n";
+                return false;
+            }
+            for (uint j = 0; j < numZeroes; i++, j++)
+            {
+                component[zigZagMap[i]] = 0;
+            }
+            component[zigZagMap[i]] = fast >> 16;
+            lastNonZero = i;
+            i += 1;
+            continue;
+        }
+
         byte symbol = getNextSymbol(b, acTable);
         if (symbol == (byte)-1)
         {
-            std::cout << "Error: Invalid AC value\n";
+            if (reportErrors)
+                console() << "Error: Invalid AC value\n";
             return false;
         }
 
@@ -181,7 +473,8 @@ bool decodeMCUComponent(BitReader &b, int *const component, int &previousDC, con
         // smol loop •⩊•
         if (i + numZeroes >= 64)
         {
-            std::cout << "Error: Zero run-length exceeded MCU\n";
+            if (reportErrors)
+                console() << "Error: Zero run-length exceeded MCU\n";
             return false;
         }
         for (uint j = 0; j < numZeroes; i++, j++)
@@ -191,15 +484,17 @@ bool decodeMCUComponent(BitReader &b, int *const component, int &previousDC, con
 
         if (coeffLength > 10) // AC coeffs cant have a length greater than 10
         {
-            std::cout << "Error: AC coefficient length greater than 10\n";
+            if (reportErrors)
+                console() << "Error: AC coefficient length greater than 10\n";
             return false;
         }
         if (coeffLength != 0)
         {
-            coeff = b.readBits(coeffLength);
+            coeff = b.getBits(coeffLength);
             if (coeff == -1) // error with the bitreader
             {
-                std::cout << "Error: Invalid AC value\n";
+                if (reportErrors)
+                    console() << "Error: Invalid AC value\n";
                 return false;
             }
 
@@ -209,6 +504,7 @@ bool decodeMCUComponent(BitReader &b, int *const component, int &previousDC, con
             }
 
             component[zigZagMap[i]] = coeff;
+            lastNonZero = i;
             i += 1;
         }
     }
@@ -216,72 +512,470 @@ bool decodeMCUComponent(BitReader &b, int *const component, int &previousDC, con
     return true;
 }
 
-MCU *decodeHuffmanData(Header *const header)
+bool decodeMCURange(const Header *const header, BlockPlanes &planes, BitReader &b, const uint start, const uint end)
 {
-    // the real image dimensions will be equal to the actual image dimensions if the image is not using any subsampliong anyways so we arent breaking any compatibility
-    MCU *mcus = new (std::nothrow) MCU[header->mcuHeightReal * header->mcuWidthReal];
+    int previousDCs[3] = {0};
 
-    if (mcus == nullptr)
+    // this whole for loop decodes an entire MCU
+    for (uint m = start; m < end; m++)
     {
-        std::cout << "Error: Memory error\n";
-        return nullptr;
+        // at the strt of an MCU
+        if (header->restartInterval != 0 && m % header->restartInterval == 0) // its time to restart
+        {
+            // at the end of the restart interval we have to reset the previous DCs
+            previousDCs[0] = 0;
+            previousDCs[1] = 0;
+            previousDCs[2] = 0;
+
+            b.align();
+        }
+        // fill it with the coefficients from the huffman data
+        if (!decodeMCUBlocks(header, b, planes, m / planes.mcusPerRow, m % planes.mcusPerRow, previousDCs))
+        {
+            return false;
+        }
     }
+    return true;
+}
 
-    for (uint i = 0; i < 4; i++)
+bool decodeMCUBlocks(const Header *const header, BitReader &b, BlockPlanes &planes, const uint mcuRow, const uint mcuColumn, int *const previousDCs, const bool reportErrors)
+{
+    for (uint i = 0; i < header->numComponents; i++) // run a function for all the component in that MCU
     {
-        if (header->huffmanDCTables[i].set)
+        const uint vs = header->colorComponents[i].verticalSamplingFactor;
+        const uint hs = header->colorComponents[i].horizontalSamplingFactor;
+        for (uint v = 0; v < vs; ++v)
         {
-            generateCodes(header->huffmanDCTables[i]);
+            for (uint h = 0; h < hs; ++h)
+            {
+                // we call a function whose responsibility is to process a single channel of a single MCU
+                const std::size_t block = planes[i].index(mcuRow * vs + v, mcuColumn * hs + h);
+                if (!decodeMCUComponent(b,
+                                        planes[i].block(block),
+                                        planes[i].lastNonZero[block],
+                                        previousDCs[i],
+                                        header->huffmanDCTables[header->colorComponents[i].HuffmanDCTableID],
+                                        header->huffmanACTables[header->colorComponents[i].HuffmanACTableID],
+                                        reportErrors)) // we only realistically want to pass the current component
+                {
+                    return false;
+                }
+            }
         }
-        if (header->huffmanACTables[i].set)
+    }
+    return true;
+}
+
+// scans are only split for speculative decoding if every thread gets at least this many bytes
+const uint speculativeChunkBytes = 256 * 1024;
+
+// an 8x8 block decoded by a speculative decoder, from a position that may or may not be a real block boundary
+struct SpeculativeBlock
+{
+    std::size_t start = 0;          // bit position the block starts at
+    std::size_t end = 0;            // bit position right after the block
+    uint cycle = 0;                 // which block of the MCU the decoder assumed this was
+    bool follows = false;           // false if the decoder had to restart right before this block
+    int dcSums[3] = {0};            // running sum of the DC differences of every component, up to and including this block
+    std::size_t coefficients = 0;   // where the coefficients of the block start in its chunk
+    byte lastNonZero = 0;
+};
+
+// what a speculative decoder produced, the coefficients of a block are kept in zig-zag order up to its last nonzero one
+// (the first is the DC difference, not the DC value), so most blocks take a few bytes instead of 128
+struct SpeculativeChunk
+{
+    std::vector<SpeculativeBlock> blocks;
+    std::vector<int16_t> coefficients;
+
+    // appends the coefficients of block, which a decoder has just put into scratch
+    void keep(SpeculativeBlock &block, const int16_t *const scratch)
+    {
+        block.coefficients = coefficients.size();
+        for (uint i = 0; i <= block.lastNonZero; i++)
         {
-            generateCodes(header->huffmanACTables[i]);
+            coefficients.push_back(scratch[zigZagMap[i]]);
         }
     }
+};
 
-    BitReader b(header->huffmanData);
+// a run of speculative blocks that turned out to be correct, or of blocks that had to be decoded for real
+struct SpeculativeRun
+{
+    uint chunk = 0;
+    std::size_t first = 0;        // first and last index into the blocks of the chunk
+    std::size_t last = 0;
+    std::size_t block = 0;        // index of the first block in the whole scan
+    int previousDCs[3] = {0};     // DC predictions going into the run
+};
 
-    int previousDCs[3] = {0};
-    uint restartInterval = header->restartInterval * header->horizontalSamplingFactor * header->verticalSamplingFactor;
+bool decodeSpeculative(const Header *const header, BlockPlanes &planes, const uint mcuCount, const uint numChunks, const std::function<void(uint, uint)> &rowPlaced)
+{
+    const std::size_t totalBits = header->scanSize * 8;
+
+    // order of the 8x8 blocks inside one MCU
+    uint blockComponent[6];
+    uint blockV[6];
+    uint blockH[6];
+    uint blocksPerMCU = 0;
+    for (uint i = 0; i < header->numComponents; i++)
+    {
+        for (uint v = 0; v < header->colorComponents[i].verticalSamplingFactor; ++v)
+        {
+            for (uint h = 0; h < header->colorComponents[i].horizontalSamplingFactor; ++h)
+            {
+                blockComponent[blocksPerMCU] = i;
+                blockV[blocksPerMCU] = v;
+                blockH[blocksPerMCU] = h;
+                blocksPerMCU += 1;
+            }
+        }
+    }
+    const std::size_t totalBlocks = (std::size_t)mcuCount * blocksPerMCU;
 
-    // this whole for loop decodes an entire MCU
-    for (uint y = 0; y < header->mcuHeight; y += header->verticalSamplingFactor)
+    auto readerAt = [header](const std::size_t bit)
     {
-        for (uint x = 0; x < header->mcuWidth; x += header->horizontalSamplingFactor)
+        return BitReader(header->scanData, header->scanSize, bit);
+    };
+    auto chunkStart = [totalBits, numChunks](const uint k)
+    {
+        return totalBits / numChunks * k + (k == numChunks ? totalBits % numChunks : 0);
+    };
+    // index of the block-th block of the scan in the plane of its component, when its row of MCUs is in row planeRow of planes
+    auto blockAt = [&](const std::size_t block, const uint planeRow, uint &component)
+    {
+        const std::size_t m = block / blocksPerMCU;
+        const uint i = block % blocksPerMCU;
+        component = blockComponent[i];
+        const uint y = planeRow * header->colorComponents[component].verticalSamplingFactor + blockV[i];
+        const uint x = (m % planes.mcusPerRow) * header->colorComponents[component].horizontalSamplingFactor + blockH[i];
+        return planes[component].index(y, x);
+    };
+    auto dcTable = [header](const uint component) -> const HuffmanTable &
+    {
+        return header->huffmanDCTables[header->colorComponents[component].HuffmanDCTableID];
+    };
+    auto acTable = [header](const uint component) -> const HuffmanTable &
+    {
+        return header->huffmanACTables[header->colorComponents[component].HuffmanACTableID];
+    };
+
+    // step 1 (parallel): every chunk is decoded from its first bit, guessing that an MCU starts there
+    // a wrong guess either fails (then we try again one bit later) or, thanks to huffman codes
+    // resynchronizing on their own, usually lines up with the real block boundaries after a few blocks
+    // the blocks that have to be decoded for real in step 2 go into one more chunk at the end
+    std::vector<SpeculativeChunk> chunks(numChunks + 1);
+    auto speculate = [&](const uint k)
+    {
+        std::vector<SpeculativeBlock> &blocks = chunks[k].blocks;
+        blocks.reserve(totalBlocks / numChunks + 1);
+        int16_t scratch[64];
+        const std::size_t end = chunkStart(k + 1);
+        BitReader b = readerAt(chunkStart(k));
+        std::size_t position = b.position();
+        uint cycle = 0;
+        bool follows = false;
+        int dcSums[3] = {0};
+        while (position < end)
         {
-            // at the strt of an MCU
-            if (restartInterval != 0 && (y * header->mcuWidthReal + x) % restartInterval == 0) // its time to restart
+            blocks.emplace_back();
+            SpeculativeBlock &block = blocks.back();
+            const uint component = blockComponent[cycle];
+            int previousDC = 0;
+            if (!decodeMCUComponent(b, scratch, block.lastNonZero, previousDC, dcTable(component), acTable(component), false))
             {
-                // at the end of the restart interval we have to reset the previous DCs
-                previousDCs[0] = 0;
-                previousDCs[1] = 0;
-                previousDCs[2] = 0;
+                blocks.pop_back();
+                b = readerAt(position + 1);
+                position = b.position();
+                cycle = 0;
+                follows = false;
+                continue;
+            }
+            block.start = position;
+            block.end = b.position();
+            block.cycle = cycle;
+            block.follows = follows;
+            chunks[k].keep(block, scratch);
+            dcSums[component] += scratch[0];
+            std::copy(dcSums, dcSums + 3, block.dcSums);
+
+            position = block.end;
+            cycle = (cycle + 1) % blocksPerMCU;
+            follows = true;
+        }
+    };
 
-                b.align();
+    std::vector<std::thread> threads;
+    for (uint k = 1; k < numChunks; k++)
+    {
+        threads.emplace_back(speculate, k);
+    }
+    speculate(0);
+    for (std::thread &t : threads)
+    {
+        t.join();
+    }
+    threads.clear();
+
+    // step 2 (serial): follow the real decode from the start of the scan
+    // whenever it reaches a state (bit position and block of the MCU) some speculative decoder was also in,
+    // everything that decoder produced from there on is correct and is adopted without decoding it again
+    // otherwise we decode one block for real and check again, which normally takes only a few blocks per chunk
+    // either way the blocks end up in runs, which cover the whole scan in order
+    std::vector<SpeculativeRun> runs;
+    std::vector<SpeculativeBlock> &decoded = chunks[numChunks].blocks;
+    int16_t scratch[64];
+    int previousDCs[3] = {0};
+    std::size_t position = 0;
+    std::size_t block = 0;
+    uint k = 0;
+    while (block < totalBlocks)
+    {
+        while (k + 1 < numChunks && position >= chunkStart(k + 1))
+        {
+            k += 1;
+        }
+        const std::vector<SpeculativeBlock> &blocks = chunks[k].blocks;
+        auto it = std::lower_bound(blocks.begin(), blocks.end(), position, [](const SpeculativeBlock &sb, const std::size_t p)
+                                   { return sb.start < p; });
+        if (it != blocks.end() && it->start == position && it->cycle == block % blocksPerMCU)
+        {
+            SpeculativeRun run;
+            run.chunk = k;
+            run.first = it - blocks.begin();
+            run.last = run.first;
+            run.block = block;
+            std::copy(previousDCs, previousDCs + 3, run.previousDCs);
+            while (run.last + 1 < blocks.size() && blocks[run.last + 1].follows && block + (run.last - run.first) + 1 < totalBlocks)
+            {
+                run.last += 1;
             }
-            // fill it with the coefficients from the huffman data
-            for (uint i = 0; i < header->numComponents; i++) // run a function for all the component in that MCU
+
+            // the DC predictions going into the next run are the sum of every difference in this one
+            for (uint c = 0; c < 3; c++)
             {
-                for (uint v = 0; v < header->colorComponents[i].verticalSamplingFactor; ++v)
-                {
-                    for (uint h = 0; h < header->colorComponents[i].horizontalSamplingFactor; ++h)
-                    {
+                previousDCs[c] += blocks[run.last].dcSums[c] - (run.first > 0 ? blocks[run.first - 1].dcSums[c] : 0);
+            }
+            block += run.last - run.first + 1;
+            position = blocks[run.last].end;
+            runs.push_back(run);
+            continue;
+        }
 
-                        // we call a function whose responsibility is to process a single channel of a single MCU
-                        if (!decodeMCUComponent(b,
-                                                mcus[(y + v) * header->mcuWidthReal + (x + h)][i],
-                                                previousDCs[i],
-                                                header->huffmanDCTables[header->colorComponents[i].HuffmanDCTableID],
-                                                header->huffmanACTables[header->colorComponents[i].HuffmanACTableID])) // we only realistically want to pass the current component
-                        {
-                            delete[] mcus;
-                            return nullptr;
-                        }
-                    }
+        // decoded like the speculative blocks, with the DC difference in place of the DC value
+        const uint component = blockComponent[block % blocksPerMCU];
+        decoded.emplace_back();
+        SpeculativeBlock &real = decoded.back();
+        BitReader b = readerAt(position);
+        int difference = 0;
+        if (!decodeMCUComponent(b, scratch, real.lastNonZero, difference, dcTable(component), acTable(component)))
+        {
+            return false;
+        }
+        chunks[numChunks].keep(real, scratch);
+        if (decoded.size() > 1)
+        {
+            std::copy(decoded[decoded.size() - 2].dcSums, decoded[decoded.size() - 2].dcSums + 3, real.dcSums);
+        }
+        real.dcSums[component] += scratch[0];
+
+        // blocks decoded one after the other make up a single run
+        if (!runs.empty() && runs.back().chunk == numChunks && runs.back().block + (runs.back().last - runs.back().first) + 1 == block)
+        {
+            runs.back().last += 1;
+        }
+        else
+        {
+            SpeculativeRun run;
+            run.chunk = numChunks;
+            run.first = decoded.size() - 1;
+            run.last = run.first;
+            run.block = block;
+            std::copy(previousDCs, previousDCs + 3, run.previousDCs);
+            runs.push_back(run);
+        }
+        previousDCs[component] += scratch[0];
+
+        position = b.position();
+        block += 1;
+    }
+
+    // step 3 (parallel): copy the blocks into place row of MCUs by row of MCUs, turning the DC differences into DC values
+    const uint mcuRows = mcuCount / planes.mcusPerRow;
+    const std::size_t blocksPerRow = (std::size_t)planes.mcusPerRow * blocksPerMCU;
+    auto placeRow = [&](const uint row, const uint planeRow)
+    {
+        const std::size_t start = row * blocksPerRow;
+        const std::size_t end = start + blocksPerRow;
+
+        // the last run that starts at or before the row
+        auto run = std::upper_bound(runs.begin(), runs.end(), start, [](const std::size_t b, const SpeculativeRun &r)
+                                    { return b < r.block; }) - 1;
+        for (; run != runs.end() && run->block < end; ++run)
+        {
+            const std::vector<SpeculativeBlock> &blocks = chunks[run->chunk].blocks;
+            const int16_t *const coefficients = chunks[run->chunk].coefficients.data();
+            const std::size_t from = std::max(start, run->block);
+            const std::size_t to = std::min(end, run->block + (run->last - run->first) + 1);
+
+            // the predictions going into the run plus every difference in it before the first block of the row
+            const std::size_t first = run->first + (from - run->block);
+            int dcs[3];
+            for (uint c = 0; c < 3; c++)
+            {
+                dcs[c] = run->previousDCs[c] + (first > 0 ? blocks[first - 1].dcSums[c] : 0) - (run->first > 0 ? blocks[run->first - 1].dcSums[c] : 0);
+            }
+            for (std::size_t i = first; i < first + (to - from); i++)
+            {
+                uint component;
+                const std::size_t index = blockAt(from + (i - first), planeRow, component);
+                int16_t *const target = planes[component].block(index);
+                const int16_t *const kept = coefficients + blocks[i].coefficients;
+                std::fill(target, target + 64, 0);
+                for (uint z = 1; z <= blocks[i].lastNonZero; z++)
+                {
+                    target[zigZagMap[z]] = kept[z];
                 }
+                planes[component].lastNonZero[index] = blocks[i].lastNonZero;
+                dcs[component] += kept[0];
+                target[0] = dcs[component];
             }
         }
+    };
+    std::atomic<uint> nextRow(0);
+    auto place = [&](const uint t)
+    {
+        for (uint row = nextRow++; row < mcuRows; row = nextRow++)
+        {
+            placeRow(row, rowPlaced ? t : row);
+            if (rowPlaced)
+            {
+                rowPlaced(row, t);
+            }
+        }
+    };
+    for (uint t = 1; t < numChunks; t++)
+    {
+        threads.emplace_back(place, t);
+    }
+    place(0);
+    for (std::thread &t : threads)
+    {
+        t.join();
+    }
+    return true;
+}
+
+BlockPlanes *decodeHuffmanData(Header *const header, uint numThreads)
+{
+    BlockPlanes *planes = new (std::nothrow) BlockPlanes;
+    if (planes == nullptr)
+    {
+        console() << "Error: Memory error\n";
+        return nullptr;
+    }
+    if (!decodeHuffmanData(header, *planes, numThreads))
+    {
+        delete planes;
+        return nullptr;
+    }
+    return planes;
+}
+
+bool decodeHuffmanData(Header *const header, BlockPlanes &planes, uint numThreads)
+{
+    // the real image dimensions will be equal to the actual image dimensions if the image is not using any subsampliong anyways so we arent breaking any compatibility
+    // counted in whole MCUs, so with 2x2 sampling four 8x8 luma blocks make up one
+    const uint mcusPerRow = header->mcuWidthReal / header->horizontalSamplingFactor;
+    const uint mcuRows = header->mcuHeightReal / header->verticalSamplingFactor;
+    const uint mcuCount = mcusPerRow * mcuRows;
+
+    if (!planes.allocate(header, mcusPerRow, mcuRows))
+    {
+        console() << "Error: Memory error\n";
+        return false;
+    }
+
+    generateHuffmanTables(header);
+
+    if (numThreads == 0)
+    {
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // without restart markers (or if the file has fewer/more of them than DRI says) the whole scan is read in one go
+    if (!hasRestartSegments(header, mcuCount))
+    {
+        // unless it is big enough to be worth decoding speculatively in chunks
+        const uint numChunks = std::min<std::size_t>(numThreads, header->scanSize / speculativeChunkBytes);
+        if (header->restartInterval == 0 && numChunks > 1)
+        {
+            return decodeSpeculative(header, planes, mcuCount, numChunks);
+        }
+
+        BitReader b(header->scanData, header->scanSize);
+        return decodeMCURange(header, planes, b, 0, mcuCount);
+    }
+
+    auto decodeRange = [header, &planes](BitReader &b, const uint start, const uint end)
+    {
+        return decodeMCURange(header, planes, b, start, end);
+    };
+    return forEachRestartSegment(header, mcuCount, numThreads, decodeRange);
+}
+
+bool hasRestartSegments(const Header *const header, const uint mcuCount)
+{
+    if (header->restartInterval == 0)
+    {
+        return false;
+    }
+    const uint segmentCount = (mcuCount + header->restartInterval - 1) / header->restartInterval;
+    return header->restartOffsets.size() == segmentCount;
+}
+
+bool forEachRestartSegment(const Header *const header, const uint mcuCount, uint numThreads, const std::function<bool(BitReader &, uint, uint)> &decodeRange)
+{
+    const uint segmentCount = header->restartOffsets.size();
+
+    // every restart segment starts byte aligned with the DC predictions reset to 0
+    // so each one can be decoded on its own thread
+    auto decodeSegment = [header, mcuCount, &decodeRange](const uint segment) -> bool
+    {
+        const std::size_t begin = header->restartOffsets[segment];
+        const std::size_t end = segment + 1 < header->restartOffsets.size() ? header->restartOffsets[segment + 1] : header->scanSize;
+        BitReader b(header->scanData + begin, end - begin);
+        return decodeRange(b, segment * header->restartInterval, std::min(mcuCount, (segment + 1) * header->restartInterval));
+    };
+
+    if (numThreads == 0)
+    {
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
     }
+    numThreads = std::min(numThreads, segmentCount);
+
+    std::atomic<uint> nextSegment(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&]()
+    {
+        for (uint segment = nextSegment++; segment < segmentCount && !failed; segment = nextSegment++)
+        {
+            if (!decodeSegment(segment))
+            {
+                failed = true;
+            }
+        }
+    };
 
-    return mcus;
-}
\ No newline at end of file
+    std::vector<std::thread> threads;
+    for (uint i = 1; i < numThreads; i++)
+    {
+        threads.emplace_back(worker);
+    }
+    worker(); // the calling thread works through segments too
+    for (std::thread &t : threads)
+    {
+        t.join();
+    }
+    return !failed;
+}
@@ -0,0 +1,305 @@
+#include <iostream>
+#include <functional>
+#include "jpg.h"
+
+// decodes a jpg that arrives in pieces (a download or an upload that is still going on)
+// every time a whole row of MCUs has been decoded its pixels are handed to a callback, so they can be shown before the rest of the file is there
+class IncrementalDecoder;
+
+// returns the offset just past the SOS marker segment, or 0 if the data doesnt reach that far yet
+// if the markers dont make sense it stops early, so that readMarkers gets to see (and report) the problem
+std::size_t findScanStart(const byte *const data, const std::size_t size);
+
+// Definitions
+
+class IncrementalDecoder
+{
+public:
+    // pixels holds rowCount rows of header.width RGB triples (top row first), the first of them is row firstRow of the image
+    typedef std::function<void(const Header &header, const byte *pixels, uint firstRow, uint rowCount)> RowCallback;
+
+    explicit IncrementalDecoder(const RowCallback &callback)
+        : onRows(callback)
+    {
+    }
+
+    IncrementalDecoder(const IncrementalDecoder &) = delete;
+    IncrementalDecoder &operator=(const IncrementalDecoder &) = delete;
+
+    ~IncrementalDecoder()
+    {
+        delete header;
+    }
+
+    // takes the next length bytes of the file, chunks can be of any size and split markers or MCUs anywhere
+    // decodes as many rows as the data so far allows and returns false once the file has turned out to be invalid
+    bool feed(const byte *const data, const std::size_t length);
+
+    // true once every row of the image has been handed to the callback
+    bool finished() const
+    {
+        return header != nullptr && mcuRow == header->mcuHeightReal / header->verticalSamplingFactor;
+    }
+
+    // nullptr until every marker up to SOS has arrived
+    const Header *getHeader() const
+    {
+        return header;
+    }
+
+private:
+    RowCallback onRows;
+    std::vector<byte> buffer; // the part of the file that is still needed, once the header is read it starts somewhere in the scan
+    Header *header = nullptr;
+    BlockPlanes rowPlanes;    // one row of MCUs, reused for every row
+    std::vector<byte> pixels; // the pixels of one row of MCUs
+
+    std::size_t position = 0;    // bit in buffer where the next row of MCUs starts
+    std::size_t scanChecked = 0; // bytes of buffer that are known to be scan data (the rest could still turn out to be a marker)
+    bool scanComplete = false;   // EOI has arrived
+    std::size_t waitFor = 0;     // a row that failed for lack of data isnt retried until this many bytes are there past position
+    int previousDCs[3] = {0};
+    uint mcuRow = 0; // next row of MCUs to decode
+    bool failed = false;
+
+    // reads the markers once they have all arrived, returns false if they havent yet (or are invalid)
+    bool readHeader();
+
+    // checks the scan bytes that arrived since the last call for markers
+    bool checkScan();
+
+    // decodes the next row of MCUs from the first available bytes of buffer into rowPlanes
+    // nothing is changed if the row cant be decoded (yet)
+    bool decodeRow(const std::size_t available, const bool reportErrors);
+};
+
+bool IncrementalDecoder::feed(const byte *const data, const std::size_t length)
+{
+    if (failed)
+    {
+        return false;
+    }
+    if (scanComplete)
+    {
+        return true; // anything after EOI is ignored
+    }
+    buffer.insert(buffer.end(), data, data + length);
+
+    if (header == nullptr && !readHeader())
+    {
+        return !failed;
+    }
+    if (!checkScan())
+    {
+        return false;
+    }
+
+    const uint mcuRows = header->mcuHeightReal / header->verticalSamplingFactor;
+    while (mcuRow < mcuRows)
+    {
+        // retrying after every tiny chunk would decode the same row over and over, so wait for half again as much data
+        const std::size_t available = scanChecked - position / 8;
+        if (!scanComplete && available < waitFor)
+        {
+            break;
+        }
+
+        // a row can only fail for lack of data until EOI shows up, after that its an error
+        if (!decodeRow(scanChecked, scanComplete))
+        {
+            if (scanComplete)
+            {
+                failed = true;
+                return false;
+            }
+            waitFor = available + available / 2 + 1;
+            break;
+        }
+        waitFor = 0;
+
+        inverseDCT(header, rowPlanes);
+
+        const uint firstRow = mcuRow * header->verticalSamplingFactor * 8;
+        const uint rowCount = std::min(header->verticalSamplingFactor * 8u, header->height - firstRow);
+        YCbCrToRGB(header, rowPlanes, pixels.data(), rowCount);
+        onRows(*header, pixels.data(), firstRow, rowCount);
+        mcuRow += 1;
+    }
+
+    // forget the part of the scan that has been decoded, whole bytes only so the bit position stays valid
+    const std::size_t consumed = position / 8;
+    if (consumed > 0 && consumed * 2 >= buffer.size())
+    {
+        buffer.erase(buffer.begin(), buffer.begin() + consumed);
+        position -= consumed * 8;
+        scanChecked -= consumed;
+    }
+    return true;
+}
+
+bool IncrementalDecoder::readHeader()
+{
+    const std::size_t headerSize = findScanStart(buffer.data(), buffer.size());
+    if (headerSize == 0)
+    {
+        return false;
+    }
+
+    header = new (std::nothrow) Header;
+    if (header == nullptr)
+    {
+        console() << "ERROR: Memory error\n";
+        failed = true;
+        return false;
+    }
+
+    ByteReader reader(buffer.data(), headerSize);
+    readMarkers(reader, header);
+    if (header->valid)
+    {
+        validateHeader(header);
+    }
+    if (!header->valid)
+    {
+        failed = true;
+        return false;
+    }
+
+    generateHuffmanTables(header);
+    if (!rowPlanes.allocate(header, header->mcuWidthReal / header->horizontalSamplingFactor, 1))
+    {
+        console() << "Error: Memory error\n";
+        failed = true;
+        return false;
+    }
+    pixels.resize((std::size_t)header->width * header->verticalSamplingFactor * 8 * 3);
+
+    // from here on buffer only holds the scan
+    buffer.erase(buffer.begin(), buffer.begin() + (reader.current() - buffer.data()));
+    return true;
+}
+
+bool IncrementalDecoder::checkScan()
+{
+    while (scanChecked < buffer.size())
+    {
+        const std::size_t pos = findMarkerByte(buffer.data() + scanChecked, buffer.data() + buffer.size()) - buffer.data();
+        if (pos + 1 >= buffer.size())
+        {
+            // plain data up to the end, or a 0xFF whose second byte hasnt arrived yet
+            scanChecked = pos;
+            break;
+        }
+
+        const byte current = buffer[pos + 1];
+        if (current == EOI)
+        {
+            scanChecked = pos;
+            scanComplete = true;
+            break;
+        }
+        // stuffed 0xFF or restart marker, BitReader deals with both
+        else if (current == 0x00 || (current >= RST0 && current <= RST7))
+        {
+            scanChecked = pos + 2;
+        }
+        // ignore multiple 0xFF's in a row
+        else if (current == 0xFF)
+        {
+            scanChecked = pos + 1;
+        }
+        else
+        {
+            console() << "Error: Invalid marker during compressed data scan. 0x" << std::hex << (uint)current << std::dec << "\n";
+            failed = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool IncrementalDecoder::decodeRow(const std::size_t available, const bool reportErrors)
+{
+    BitReader b(buffer.data(), available, position);
+    int dcs[3] = {previousDCs[0], previousDCs[1], previousDCs[2]};
+
+    const uint mcusPerRow = header->mcuWidthReal / header->horizontalSamplingFactor;
+    for (uint x = 0; x < mcusPerRow; x++)
+    {
+        const uint m = mcuRow * mcusPerRow + x;
+        if (header->restartInterval != 0 && m % header->restartInterval == 0)
+        {
+            dcs[0] = 0;
+            dcs[1] = 0;
+            dcs[2] = 0;
+            b.align();
+        }
+        if (!decodeMCUBlocks(header, b, rowPlanes, 0, x, dcs, reportErrors))
+        {
+            return false;
+        }
+    }
+
+    position = b.position();
+    previousDCs[0] = dcs[0];
+    previousDCs[1] = dcs[1];
+    previousDCs[2] = dcs[2];
+    return true;
+}
+
+std::size_t findScanStart(const byte *const data, const std::size_t size)
+{
+    if (size < 2)
+    {
+        return 0;
+    }
+    if (data[0] != 0xFF || data[1] != SOI)
+    {
+        return size;
+    }
+
+    std::size_t pos = 2;
+    while (pos < size)
+    {
+        if (data[pos] != 0xFF)
+        {
+            return pos; // expected a marker
+        }
+        // any number of FF's are allowed before the marker
+        while (pos < size && data[pos] == 0xFF)
+        {
+            pos += 1;
+        }
+        if (pos >= size)
+        {
+            return 0;
+        }
+
+        const byte current = data[pos];
+        pos += 1;
+        if (current == TEM)
+        {
+            continue; // no length
+        }
+        if (current == SOI || current == EOI || (current >= RST0 && current <= RST7))
+        {
+            return pos; // not allowed before SOS
+        }
+
+        if (pos + 2 > size)
+        {
+            return 0;
+        }
+        const uint length = (data[pos] << 8) + data[pos + 1];
+        if (length < 2)
+        {
+            return pos;
+        }
+        pos += length;
+        if (current == SOS)
+        {
+            return pos <= size ? pos : 0;
+        }
+    }
+    return 0;
+}
@@ -1,26 +1,95 @@
 #include <iostream>
 #include <cmath>
 #include <fstream>
+#include <random>
+#include <cstring>
+#include <algorithm>
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 #include "jpg.h"
 
-// perform inverse DCT on mcu array
-void inverseDCT(const Header *const header, MCU *const mcus);
+// perform inverse DCT on every block of every component, straight from the quantized coefficients
+void inverseDCT(const Header *const header, BlockPlanes &planes);
 
 // inverse DCT on each mcu
-void inverseDCTComponent(int *const component);
+// prescaled is QuantizationTable::prescaled, the first pass multiplies every coefficient by it so the block doesnt have to be dequantized first
+void inverseDCTComponent(const float *const prescaled, int16_t *const component);
 
-void inverseDCTComponent(int *const component)
+// picks the cheapest transform of the given method that still covers every nonzero coefficient of the block
+// size is Header::blockSize(component), below 8 only the top left size x size samples of the block are written (at a row stride of 8, like the full block)
+void inverseDCTBlock(const QuantizationTable &qTable, int16_t *const component, const byte lastNonZero, const IDCTMethod method, const uint size);
+
+// faster versions for blocks whose nonzero coefficients all lie in the top left corner
+// they skip the multiplications and additions with known zeros, so the result is the same as the full transform
+// the DC versions only fill the top left size x size samples, which is all a scaled decode looks at
+void inverseDCTComponentDC(const float *const prescaled, int16_t *const component, const uint size = 8);
+void inverseDCTComponent2x2(const float *const prescaled, int16_t *const component);
+void inverseDCTComponent4x4(const float *const prescaled, int16_t *const component);
+
+#if defined(__SSE2__) || defined(__AVX2__)
+// the full transform with SIMD, all eight columns at once and then (after a transpose) all eight rows at once
+// every lane goes through the same operations in the same order as inverseDCTComponent, so the output is identical
+void inverseDCTComponentSIMD(const float *const prescaled, int16_t *const component);
+
+// one 1-D transform in every lane, in holds inputs 0 to 7 (already scaled) and out gets outputs 0 to 7
+template <typename Vec>
+void inverseDCTLanes(const Vec *const in, Vec *const out);
+#endif
+
+// the integer transform (libjpeg's islow), the first pass multiplies the coefficients by qTable.table16 (saturating the products to 16 bits)
+// and keeps idctPass1Bits extra bits, both passes saturate to 16 bits so every version gives exactly the same output
+void inverseDCTComponentInteger(const QuantizationTable &qTable, int16_t *const component);
+
+// same as above for a block that only has a DC coefficient
+void inverseDCTComponentIntegerDC(const QuantizationTable &qTable, int16_t *const component, const uint size = 8);
+
+// the reduced transforms for decoding at 1/2 (size 4) and 1/4 (size 2) of the full size
+// only the lowest size x size frequencies are used, and the output goes to the top left size x size samples of the block
+// every output is the value of the full transform at the center of the pixels it stands for, so there is no need to average them afterwards
+void inverseDCTComponentScaled(const QuantizationTable &qTable, int16_t *const component, const uint size);
+void inverseDCTComponentIntegerScaled(const QuantizationTable &qTable, int16_t *const component, const uint size);
+
+// one 1-D pass of the integer transform, in[k * stride] are the inputs and out gets the outputs still scaled up by 2^idctConstBits
+// the inputs have to fit in an int16, then no sum gets past 0.94 * 2^31 (rounding for the second pass included) and nothing can overflow
+void inverseDCTInteger1D(const int *const in, const uint stride, int *const out);
+
+// rounds away the lowest bits of a fixed point value
+int descale(const int value, const int bits);
+
+// clamps to what fits in an int16
+int16_t saturate16(const int value);
+
+#if defined(__SSE2__)
+// the integer transform with eight 16 bit lanes, a whole row of the block per register
+void inverseDCTComponentIntegerSIMD(const QuantizationTable &qTable, int16_t *const component);
+#endif
+
+// runs the SIMD transforms and the scalar ones on count random blocks and compares the results
+// prints where they first differ and returns false
+bool checkInverseDCT(const uint count);
+
+// the float kernels only give the same output as each other if every multiply and add is rounded on its own,
+// so the compiler must not fuse them into FMA instructions (it would do so differently in the scalar and the SIMD code)
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+void inverseDCTComponent(const float *const prescaled, int16_t *const component)
 {
     for (uint i = 0; i < 8; i++)
     {
-        const float g0 = component[0 * 8 + i] * s0;
-        const float g1 = component[4 * 8 + i] * s4;
-        const float g2 = component[2 * 8 + i] * s2;
-        const float g3 = component[6 * 8 + i] * s6;
-        const float g4 = component[5 * 8 + i] * s5;
-        const float g5 = component[1 * 8 + i] * s1;
-        const float g6 = component[7 * 8 + i] * s7;
-        const float g7 = component[3 * 8 + i] * s3;
+        const float g0 = component[0 * 8 + i] * prescaled[0 * 8 + i];
+        const float g1 = component[4 * 8 + i] * prescaled[4 * 8 + i];
+        const float g2 = component[2 * 8 + i] * prescaled[2 * 8 + i];
+        const float g3 = component[6 * 8 + i] * prescaled[6 * 8 + i];
+        const float g4 = component[5 * 8 + i] * prescaled[5 * 8 + i];
+        const float g5 = component[1 * 8 + i] * prescaled[1 * 8 + i];
+        const float g6 = component[7 * 8 + i] * prescaled[7 * 8 + i];
+        const float g7 = component[3 * 8 + i] * prescaled[3 * 8 + i];
 
         const float f0 = g0;
         const float f1 = g1;
@@ -150,22 +219,822 @@ void inverseDCTComponent(int *const component)
     }
 }
 
-void inverseDCT(const Header *const header, MCU *const mcus)
+void inverseDCTComponentDC(const float *const prescaled, int16_t *const component, const uint size)
+{
+    // every butterfly just passes the DC through, first down column 0 and then along every row
+    const int column = component[0] * prescaled[0];
+    const int value = column * s0;
+    for (uint y = 0; y < size; y++)
+    {
+        std::fill(component + y * 8, component + y * 8 + size, value);
+    }
+}
+
+void inverseDCTComponentScaled(const QuantizationTable &qTable, int16_t *const component, const uint size)
+{
+    const float *const basis = size == 4 ? reducedBasis4 : reducedBasis2;
+
+    // columns into workspace[y * size + u], dequantized on the way
+    float workspace[16];
+    for (uint u = 0; u < size; u++)
+    {
+        float in[4];
+        for (uint v = 0; v < size; v++)
+        {
+            in[v] = component[v * 8 + u] * (float)qTable.table[v * 8 + u];
+        }
+        for (uint y = 0; y < size; y++)
+        {
+            float sum = 0;
+            for (uint v = 0; v < size; v++)
+            {
+                sum += basis[y * size + v] * in[v];
+            }
+            workspace[y * size + u] = sum;
+        }
+    }
+
+    // then the rows, straight into the block (the inputs are all in workspace by now)
+    for (uint y = 0; y < size; y++)
+    {
+        for (uint x = 0; x < size; x++)
+        {
+            float sum = 0;
+            for (uint u = 0; u < size; u++)
+            {
+                sum += basis[x * size + u] * workspace[y * size + u];
+            }
+            component[y * 8 + x] = sum;
+        }
+    }
+}
+
+void inverseDCTComponent2x2(const float *const prescaled, int16_t *const component)
+{
+    // only inputs 0 and 1 of each 1-D transform can be nonzero
+    for (uint i = 0; i < 2; i++)
+    {
+        const float g0 = component[0 * 8 + i] * prescaled[0 * 8 + i];
+        const float g5 = component[1 * 8 + i] * prescaled[1 * 8 + i];
+
+        const float d5 = g5 * m3;
+        const float d6 = g5 * m4;
+        const float d8 = g5 * m5;
+
+        const float c5 = d5 + g5;
+        const float c6 = d6 - d8;
+        const float c8 = c5 - c6;
+
+        const float b4 = d8 - c8;
+        const float b6 = c6 - g5;
+
+        component[0 * 8 + i] = g0 + g5;
+        component[1 * 8 + i] = g0 + b6;
+        component[2 * 8 + i] = g0 + c8;
+        component[3 * 8 + i] = g0 + b4;
+        component[4 * 8 + i] = g0 - b4;
+        component[5 * 8 + i] = g0 - c8;
+        component[6 * 8 + i] = g0 - b6;
+        component[7 * 8 + i] = g0 - g5;
+    }
+
+    for (uint i = 0; i < 8; i++)
+    {
+        const float g0 = component[i * 8 + 0] * s0;
+        const float g5 = component[i * 8 + 1] * s1;
+
+        const float d5 = g5 * m3;
+        const float d6 = g5 * m4;
+        const float d8 = g5 * m5;
+
+        const float c5 = d5 + g5;
+        const float c6 = d6 - d8;
+        const float c8 = c5 - c6;
+
+        const float b4 = d8 - c8;
+        const float b6 = c6 - g5;
+
+        component[i * 8 + 0] = g0 + g5;
+        component[i * 8 + 1] = g0 + b6;
+        component[i * 8 + 2] = g0 + c8;
+        component[i * 8 + 3] = g0 + b4;
+        component[i * 8 + 4] = g0 - b4;
+        component[i * 8 + 5] = g0 - c8;
+        component[i * 8 + 6] = g0 - b6;
+        component[i * 8 + 7] = g0 - g5;
+    }
+}
+
+void inverseDCTComponent4x4(const float *const prescaled, int16_t *const component)
+{
+    // only inputs 0 to 3 of each 1-D transform can be nonzero
+    for (uint i = 0; i < 4; i++)
+    {
+        const float g0 = component[0 * 8 + i] * prescaled[0 * 8 + i];
+        const float g2 = component[2 * 8 + i] * prescaled[2 * 8 + i];
+        const float g5 = component[1 * 8 + i] * prescaled[1 * 8 + i];
+        const float g7 = component[3 * 8 + i] * prescaled[3 * 8 + i];
+
+        const float e5 = g5 - g7;
+        const float e7 = g5 + g7;
+
+        const float d2 = g2 * ml;
+        const float d4 = -g7 * m2;
+        const float d5 = e5 * m3;
+        const float d6 = g5 * m4;
+        const float d8 = e5 * m5;
+
+        const float c2 = d2 - g2;
+        const float c4 = d4 + d8;
+        const float c5 = d5 + e7;
+        const float c6 = d6 - d8;
+        const float c8 = c5 - c6;
+
+        const float b0 = g0 + g2;
+        const float b1 = g0 + c2;
+        const float b2 = g0 - c2;
+        const float b3 = g0 - g2;
+        const float b4 = c4 - c8;
+        const float b6 = c6 - e7;
+
+        component[0 * 8 + i] = b0 + e7;
+        component[1 * 8 + i] = b1 + b6;
+        component[2 * 8 + i] = b2 + c8;
+        component[3 * 8 + i] = b3 + b4;
+        component[4 * 8 + i] = b3 - b4;
+        component[5 * 8 + i] = b2 - c8;
+        component[6 * 8 + i] = b1 - b6;
+        component[7 * 8 + i] = b0 - e7;
+    }
+
+    for (uint i = 0; i < 8; i++)
+    {
+        const float g0 = component[i * 8 + 0] * s0;
+        const float g2 = component[i * 8 + 2] * s2;
+        const float g5 = component[i * 8 + 1] * s1;
+        const float g7 = component[i * 8 + 3] * s3;
+
+        const float e5 = g5 - g7;
+        const float e7 = g5 + g7;
+
+        const float d2 = g2 * ml;
+        const float d4 = -g7 * m2;
+        const float d5 = e5 * m3;
+        const float d6 = g5 * m4;
+        const float d8 = e5 * m5;
+
+        const float c2 = d2 - g2;
+        const float c4 = d4 + d8;
+        const float c5 = d5 + e7;
+        const float c6 = d6 - d8;
+        const float c8 = c5 - c6;
+
+        const float b0 = g0 + g2;
+        const float b1 = g0 + c2;
+        const float b2 = g0 - c2;
+        const float b3 = g0 - g2;
+        const float b4 = c4 - c8;
+        const float b6 = c6 - e7;
+
+        component[i * 8 + 0] = b0 + e7;
+        component[i * 8 + 1] = b1 + b6;
+        component[i * 8 + 2] = b2 + c8;
+        component[i * 8 + 3] = b3 + b4;
+        component[i * 8 + 4] = b3 - b4;
+        component[i * 8 + 5] = b2 - c8;
+        component[i * 8 + 6] = b1 - b6;
+        component[i * 8 + 7] = b0 - e7;
+    }
+}
+
+#if defined(__SSE2__) || defined(__AVX2__)
+template <typename Vec>
+void inverseDCTLanes(const Vec *const in, Vec *const out)
+{
+    const Vec g0 = in[0];
+    const Vec g1 = in[4];
+    const Vec g2 = in[2];
+    const Vec g3 = in[6];
+    const Vec g4 = in[5];
+    const Vec g5 = in[1];
+    const Vec g6 = in[7];
+    const Vec g7 = in[3];
+
+    const Vec f4 = g4 - g7;
+    const Vec f5 = g5 + g6;
+    const Vec f6 = g5 - g6;
+    const Vec f7 = g4 + g7;
+
+    const Vec e2 = g2 - g3;
+    const Vec e3 = g2 + g3;
+    const Vec e5 = f5 - f7;
+    const Vec e7 = f5 + f7;
+    const Vec e8 = f4 + f6;
+
+    const Vec d2 = e2 * ml;
+    const Vec d4 = f4 * m2;
+    const Vec d5 = e5 * m3;
+    const Vec d6 = f6 * m4;
+    const Vec d8 = e8 * m5;
+
+    const Vec c0 = g0 + g1;
+    const Vec c1 = g0 - g1;
+    const Vec c2 = d2 - e3;
+    const Vec c4 = d4 + d8;
+    const Vec c5 = d5 + e7;
+    const Vec c6 = d6 - d8;
+    const Vec c8 = c5 - c6;
+
+    const Vec b0 = c0 + e3;
+    const Vec b1 = c1 + c2;
+    const Vec b2 = c1 - c2;
+    const Vec b3 = c0 - e3;
+    const Vec b4 = c4 - c8;
+    const Vec b6 = c6 - e7;
+
+    out[0] = b0 + e7;
+    out[1] = b1 + b6;
+    out[2] = b2 + c8;
+    out[3] = b3 + b4;
+    out[4] = b3 - b4;
+    out[5] = b2 - c8;
+    out[6] = b1 - b6;
+    out[7] = b0 - e7;
+}
+
+// instantiated here, so the instance gets the options above (otherwise that would only happen at the end of the translation unit)
+#if defined(__AVX2__)
+template void inverseDCTLanes<__m256>(const __m256 *const in, __m256 *const out);
+#else
+template void inverseDCTLanes<__m128>(const __m128 *const in, __m128 *const out);
+#endif
+#endif
+
+#if defined(__AVX2__)
+// what storing to an int16 and reading it back does to a float: truncated towards 0 and wrapped to 16 bits
+inline __m256i truncateToInt16(const __m256 v)
+{
+    return _mm256_srai_epi32(_mm256_slli_epi32(_mm256_cvttps_epi32(v), 16), 16);
+}
+
+// rows[k] becomes column k
+inline void transpose8x8(__m256 *const rows)
+{
+    const __m256 t0 = _mm256_unpacklo_ps(rows[0], rows[1]);
+    const __m256 t1 = _mm256_unpackhi_ps(rows[0], rows[1]);
+    const __m256 t2 = _mm256_unpacklo_ps(rows[2], rows[3]);
+    const __m256 t3 = _mm256_unpackhi_ps(rows[2], rows[3]);
+    const __m256 t4 = _mm256_unpacklo_ps(rows[4], rows[5]);
+    const __m256 t5 = _mm256_unpackhi_ps(rows[4], rows[5]);
+    const __m256 t6 = _mm256_unpacklo_ps(rows[6], rows[7]);
+    const __m256 t7 = _mm256_unpackhi_ps(rows[6], rows[7]);
+
+    const __m256 u0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 u1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    const __m256 u2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 u3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    const __m256 u4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 u5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    const __m256 u6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 u7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+    rows[0] = _mm256_permute2f128_ps(u0, u4, 0x20);
+    rows[1] = _mm256_permute2f128_ps(u1, u5, 0x20);
+    rows[2] = _mm256_permute2f128_ps(u2, u6, 0x20);
+    rows[3] = _mm256_permute2f128_ps(u3, u7, 0x20);
+    rows[4] = _mm256_permute2f128_ps(u0, u4, 0x31);
+    rows[5] = _mm256_permute2f128_ps(u1, u5, 0x31);
+    rows[6] = _mm256_permute2f128_ps(u2, u6, 0x31);
+    rows[7] = _mm256_permute2f128_ps(u3, u7, 0x31);
+}
+
+void inverseDCTComponentSIMD(const float *const prescaled, int16_t *const component)
+{
+    // one row of the block per register, so lane i works on column i
+    __m256 rows[8];
+    __m256 out[8];
+    for (uint k = 0; k < 8; k++)
+    {
+        const __m256i coefficients = _mm256_cvtepi16_epi32(_mm_load_si128((const __m128i *)(component + k * 8)));
+        rows[k] = _mm256_mul_ps(_mm256_cvtepi32_ps(coefficients), _mm256_load_ps(prescaled + k * 8));
+    }
+    inverseDCTLanes(rows, out);
+
+    // the scalar code goes through the int16 block between the passes, so the same rounding happens here
+    const float scales[8] = {s0, s1, s2, s3, s4, s5, s6, s7};
+    for (uint k = 0; k < 8; k++)
+    {
+        rows[k] = _mm256_cvtepi32_ps(truncateToInt16(out[k]));
+    }
+    transpose8x8(rows);
+    for (uint k = 0; k < 8; k++)
+    {
+        rows[k] = _mm256_mul_ps(rows[k], _mm256_set1_ps(scales[k]));
+    }
+    inverseDCTLanes(rows, out);
+    transpose8x8(out);
+
+    for (uint k = 0; k < 8; k++)
+    {
+        const __m256i values = truncateToInt16(out[k]);
+        _mm_store_si128((__m128i *)(component + k * 8), _mm_packs_epi32(_mm256_castsi256_si128(values), _mm256_extracti128_si256(values, 1)));
+    }
+}
+#elif defined(__SSE2__)
+// what storing to an int16 and reading it back does to a float: truncated towards 0 and wrapped to 16 bits
+inline __m128i truncateToInt16(const __m128 v)
+{
+    return _mm_srai_epi32(_mm_slli_epi32(_mm_cvttps_epi32(v), 16), 16);
+}
+
+// in[h][k] holds columns 4h to 4h+3 of row k, out[h][k] gets rows 4h to 4h+3 of column k
+inline void transpose8x8(const __m128 (*const in)[8], __m128 (*const out)[8])
+{
+    for (uint v = 0; v < 2; v++)
+    {
+        for (uint h = 0; h < 2; h++)
+        {
+            __m128 r0 = in[h][4 * v + 0];
+            __m128 r1 = in[h][4 * v + 1];
+            __m128 r2 = in[h][4 * v + 2];
+            __m128 r3 = in[h][4 * v + 3];
+            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+            out[v][4 * h + 0] = r0;
+            out[v][4 * h + 1] = r1;
+            out[v][4 * h + 2] = r2;
+            out[v][4 * h + 3] = r3;
+        }
+    }
+}
+
+void inverseDCTComponentSIMD(const float *const prescaled, int16_t *const component)
+{
+    // every row of the block takes two registers, the left and the right half
+    __m128 halves[2][8];
+    __m128 out[2][8];
+    for (uint k = 0; k < 8; k++)
+    {
+        const __m128i coefficients = _mm_load_si128((const __m128i *)(component + k * 8));
+        const __m128i left = _mm_srai_epi32(_mm_unpacklo_epi16(coefficients, coefficients), 16);
+        const __m128i right = _mm_srai_epi32(_mm_unpackhi_epi16(coefficients, coefficients), 16);
+        halves[0][k] = _mm_mul_ps(_mm_cvtepi32_ps(left), _mm_load_ps(prescaled + k * 8));
+        halves[1][k] = _mm_mul_ps(_mm_cvtepi32_ps(right), _mm_load_ps(prescaled + k * 8 + 4));
+    }
+    inverseDCTLanes(halves[0], out[0]);
+    inverseDCTLanes(halves[1], out[1]);
+
+    // the scalar code goes through the int16 block between the passes, so the same rounding happens here
+    const float scales[8] = {s0, s1, s2, s3, s4, s5, s6, s7};
+    for (uint h = 0; h < 2; h++)
+    {
+        for (uint k = 0; k < 8; k++)
+        {
+            out[h][k] = _mm_cvtepi32_ps(truncateToInt16(out[h][k]));
+        }
+    }
+    transpose8x8(out, halves);
+    for (uint h = 0; h < 2; h++)
+    {
+        for (uint k = 0; k < 8; k++)
+        {
+            halves[h][k] = _mm_mul_ps(halves[h][k], _mm_set1_ps(scales[k]));
+        }
+        inverseDCTLanes(halves[h], out[h]);
+    }
+    transpose8x8(out, halves);
+
+    for (uint k = 0; k < 8; k++)
+    {
+        _mm_store_si128((__m128i *)(component + k * 8), _mm_packs_epi32(truncateToInt16(halves[0][k]), truncateToInt16(halves[1][k])));
+    }
+}
+#endif
+
+int descale(const int value, const int bits)
+{
+    return (value + (1 << (bits - 1))) >> bits;
+}
+
+int16_t saturate16(const int value)
+{
+    return (int16_t)std::min(32767, std::max(-32768, value));
+}
+
+void inverseDCTInteger1D(const int *const in, const uint stride, int *const out)
+{
+    // even part, the rotation of inputs 2 and 6
+    const int z1 = (in[2 * stride] + in[6 * stride]) * fix0541196100;
+    const int even2 = z1 - in[6 * stride] * fix1847759065;
+    const int even3 = z1 + in[2 * stride] * fix0765366865;
+    const int even0 = (in[0 * stride] + in[4 * stride]) * (1 << idctConstBits);
+    const int even1 = (in[0 * stride] - in[4 * stride]) * (1 << idctConstBits);
+
+    const int tmp10 = even0 + even3;
+    const int tmp13 = even0 - even3;
+    const int tmp11 = even1 + even2;
+    const int tmp12 = even1 - even2;
+
+    // odd part, inputs 7, 5, 3 and 1
+    const int odd0 = in[7 * stride];
+    const int odd1 = in[5 * stride];
+    const int odd2 = in[3 * stride];
+    const int odd3 = in[1 * stride];
+
+    const int z5 = (odd0 + odd1 + odd2 + odd3) * fix1175875602;
+    const int y1 = (odd0 + odd3) * -fix0899976223;
+    const int y2 = (odd1 + odd2) * -fix2562915447;
+    const int y3 = (odd0 + odd2) * -fix1961570560 + z5;
+    const int y4 = (odd1 + odd3) * -fix0390180644 + z5;
+
+    const int tmp0 = odd0 * fix0298631336 + y1 + y3;
+    const int tmp1 = odd1 * fix2053119869 + y2 + y4;
+    const int tmp2 = odd2 * fix3072711026 + y2 + y3;
+    const int tmp3 = odd3 * fix1501321110 + y1 + y4;
+
+    out[0] = tmp10 + tmp3;
+    out[7] = tmp10 - tmp3;
+    out[1] = tmp11 + tmp2;
+    out[6] = tmp11 - tmp2;
+    out[2] = tmp12 + tmp1;
+    out[5] = tmp12 - tmp1;
+    out[3] = tmp13 + tmp0;
+    out[4] = tmp13 - tmp0;
+}
+
+void inverseDCTComponentInteger(const QuantizationTable &qTable, int16_t *const component)
+{
+    int workspace[64];
+    int out[8];
+
+    // columns, dequantized on the way
+    for (uint i = 0; i < 64; i++)
+    {
+        workspace[i] = saturate16(component[i] * qTable.table16[i]);
+    }
+    for (uint i = 0; i < 8; i++)
+    {
+        inverseDCTInteger1D(workspace + i, 8, out);
+        for (uint k = 0; k < 8; k++)
+        {
+            workspace[k * 8 + i] = saturate16(descale(out[k], idctConstBits - idctPass1Bits));
+        }
+    }
+
+    // rows, the extra 3 bits are the factor of 8 the two passes leave in
+    for (uint i = 0; i < 8; i++)
+    {
+        inverseDCTInteger1D(workspace + i * 8, 1, out);
+        for (uint k = 0; k < 8; k++)
+        {
+            component[i * 8 + k] = saturate16(descale(out[k], idctConstBits + idctPass1Bits + 3));
+        }
+    }
+}
+
+void inverseDCTComponentIntegerDC(const QuantizationTable &qTable, int16_t *const component, const uint size)
+{
+    // every other input is 0, so each pass just scales the DC
+    const int dc = saturate16(component[0] * qTable.table16[0]);
+    const int column = saturate16(descale(dc * (1 << idctConstBits), idctConstBits - idctPass1Bits));
+    const int16_t value = saturate16(descale(column * (1 << idctConstBits), idctConstBits + idctPass1Bits + 3));
+    for (uint y = 0; y < size; y++)
+    {
+        std::fill(component + y * 8, component + y * 8 + size, value);
+    }
+}
+
+void inverseDCTComponentIntegerScaled(const QuantizationTable &qTable, int16_t *const component, const uint size)
+{
+    const int *const basis = size == 4 ? reducedBasis4Fixed : reducedBasis2Fixed;
+
+    // columns into workspace[y * size + u], dequantized and saturated like the full transform
+    // the basis already holds the 1/8 of the two passes, so there are no extra bits to drop at the end
+    int workspace[16];
+    for (uint u = 0; u < size; u++)
+    {
+        int in[4];
+        for (uint v = 0; v < size; v++)
+        {
+            in[v] = saturate16(component[v * 8 + u] * qTable.table16[v * 8 + u]);
+        }
+        for (uint y = 0; y < size; y++)
+        {
+            int sum = 0;
+            for (uint v = 0; v < size; v++)
+            {
+                sum += basis[y * size + v] * in[v];
+            }
+            workspace[y * size + u] = saturate16(descale(sum, idctConstBits - idctPass1Bits));
+        }
+    }
+
+    for (uint y = 0; y < size; y++)
+    {
+        for (uint x = 0; x < size; x++)
+        {
+            int sum = 0;
+            for (uint u = 0; u < size; u++)
+            {
+                sum += basis[x * size + u] * workspace[y * size + u];
+            }
+            component[y * 8 + x] = saturate16(descale(sum, idctConstBits + idctPass1Bits));
+        }
+    }
+}
+
+#if defined(__SSE2__)
+// the constant pair (a, b) in every 32 bit lane, for _mm_madd_epi16 on inputs interleaved as (x, y): x * a + y * b
+inline __m128i constantPair(const int a, const int b)
+{
+    return _mm_set_epi16(b, a, b, a, b, a, b, a);
+}
+
+// one 1-D pass of the integer transform on the eight lanes of in, out gets the outputs rounded by descaleBits and saturated to 16 bits
+// the products are formed with _mm_madd_epi16 on interleaved pairs of inputs, the constants are those of inverseDCTInteger1D multiplied out
+// (integer arithmetic is exact, so the result is the same)
+inline void inverseDCTIntegerLanes(const __m128i *const in, const int descaleBits, __m128i *const out)
+{
+    const __m128i round = _mm_set1_epi32(1 << (descaleBits - 1));
+    __m128i results[2][8];
+    for (uint half = 0; half < 2; half++)
+    {
+        const __m128i in26 = half == 0 ? _mm_unpacklo_epi16(in[2], in[6]) : _mm_unpackhi_epi16(in[2], in[6]);
+        const __m128i in04 = half == 0 ? _mm_unpacklo_epi16(in[0], in[4]) : _mm_unpackhi_epi16(in[0], in[4]);
+        const __m128i in73 = half == 0 ? _mm_unpacklo_epi16(in[7], in[3]) : _mm_unpackhi_epi16(in[7], in[3]);
+        const __m128i in51 = half == 0 ? _mm_unpacklo_epi16(in[5], in[1]) : _mm_unpackhi_epi16(in[5], in[1]);
+        const __m128i in71 = half == 0 ? _mm_unpacklo_epi16(in[7], in[1]) : _mm_unpackhi_epi16(in[7], in[1]);
+        const __m128i in53 = half == 0 ? _mm_unpacklo_epi16(in[5], in[3]) : _mm_unpackhi_epi16(in[5], in[3]);
+
+        const __m128i even2 = _mm_madd_epi16(in26, constantPair(fix0541196100, fix0541196100 - fix1847759065));
+        const __m128i even3 = _mm_madd_epi16(in26, constantPair(fix0541196100 + fix0765366865, fix0541196100));
+        const __m128i even0 = _mm_madd_epi16(in04, constantPair(1 << idctConstBits, 1 << idctConstBits));
+        const __m128i even1 = _mm_madd_epi16(in04, constantPair(1 << idctConstBits, -(1 << idctConstBits)));
+
+        const __m128i tmp10 = _mm_add_epi32(even0, even3);
+        const __m128i tmp13 = _mm_sub_epi32(even0, even3);
+        const __m128i tmp11 = _mm_add_epi32(even1, even2);
+        const __m128i tmp12 = _mm_sub_epi32(even1, even2);
+
+        const __m128i y3 = _mm_add_epi32(_mm_madd_epi16(in73, constantPair(fix1175875602 - fix1961570560, fix1175875602 - fix1961570560)),
+                                         _mm_madd_epi16(in51, constantPair(fix1175875602, fix1175875602)));
+        const __m128i y4 = _mm_add_epi32(_mm_madd_epi16(in73, constantPair(fix1175875602, fix1175875602)),
+                                         _mm_madd_epi16(in51, constantPair(fix1175875602 - fix0390180644, fix1175875602 - fix0390180644)));
+
+        const __m128i tmp0 = _mm_add_epi32(_mm_madd_epi16(in71, constantPair(fix0298631336 - fix0899976223, -fix0899976223)), y3);
+        const __m128i tmp3 = _mm_add_epi32(_mm_madd_epi16(in71, constantPair(-fix0899976223, fix1501321110 - fix0899976223)), y4);
+        const __m128i tmp1 = _mm_add_epi32(_mm_madd_epi16(in53, constantPair(fix2053119869 - fix2562915447, -fix2562915447)), y4);
+        const __m128i tmp2 = _mm_add_epi32(_mm_madd_epi16(in53, constantPair(-fix2562915447, fix3072711026 - fix2562915447)), y3);
+
+        __m128i *const result = results[half];
+        result[0] = _mm_add_epi32(tmp10, tmp3);
+        result[7] = _mm_sub_epi32(tmp10, tmp3);
+        result[1] = _mm_add_epi32(tmp11, tmp2);
+        result[6] = _mm_sub_epi32(tmp11, tmp2);
+        result[2] = _mm_add_epi32(tmp12, tmp1);
+        result[5] = _mm_sub_epi32(tmp12, tmp1);
+        result[3] = _mm_add_epi32(tmp13, tmp0);
+        result[4] = _mm_sub_epi32(tmp13, tmp0);
+        for (uint k = 0; k < 8; k++)
+        {
+            result[k] = _mm_srai_epi32(_mm_add_epi32(result[k], round), descaleBits);
+        }
+    }
+    for (uint k = 0; k < 8; k++)
+    {
+        out[k] = _mm_packs_epi32(results[0][k], results[1][k]);
+    }
+}
+
+// out[k] gets column k of the 8x8 block of 16 bit values whose rows are in
+inline void transpose8x8(const __m128i *const in, __m128i *const out)
+{
+    const __m128i a0 = _mm_unpacklo_epi16(in[0], in[1]);
+    const __m128i a1 = _mm_unpackhi_epi16(in[0], in[1]);
+    const __m128i a2 = _mm_unpacklo_epi16(in[2], in[3]);
+    const __m128i a3 = _mm_unpackhi_epi16(in[2], in[3]);
+    const __m128i a4 = _mm_unpacklo_epi16(in[4], in[5]);
+    const __m128i a5 = _mm_unpackhi_epi16(in[4], in[5]);
+    const __m128i a6 = _mm_unpacklo_epi16(in[6], in[7]);
+    const __m128i a7 = _mm_unpackhi_epi16(in[6], in[7]);
+
+    const __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+    const __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+    const __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+    const __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+    const __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+    const __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+    const __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+    const __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+
+    out[0] = _mm_unpacklo_epi64(b0, b4);
+    out[1] = _mm_unpackhi_epi64(b0, b4);
+    out[2] = _mm_unpacklo_epi64(b1, b5);
+    out[3] = _mm_unpackhi_epi64(b1, b5);
+    out[4] = _mm_unpacklo_epi64(b2, b6);
+    out[5] = _mm_unpackhi_epi64(b2, b6);
+    out[6] = _mm_unpacklo_epi64(b3, b7);
+    out[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+void inverseDCTComponentIntegerSIMD(const QuantizationTable &qTable, int16_t *const component)
+{
+    // one row per register, so lane i works on column i, dequantized with the 32 bit products saturated back to 16 bits
+    __m128i rows[8];
+    __m128i out[8];
+    for (uint k = 0; k < 8; k++)
+    {
+        const __m128i coefficients = _mm_load_si128((const __m128i *)(component + k * 8));
+        const __m128i quantizers = _mm_load_si128((const __m128i *)(qTable.table16 + k * 8));
+        const __m128i low = _mm_mullo_epi16(coefficients, quantizers);
+        const __m128i high = _mm_mulhi_epi16(coefficients, quantizers);
+        rows[k] = _mm_packs_epi32(_mm_unpacklo_epi16(low, high), _mm_unpackhi_epi16(low, high));
+    }
+    inverseDCTIntegerLanes(rows, idctConstBits - idctPass1Bits, out);
+    transpose8x8(out, rows);
+    inverseDCTIntegerLanes(rows, idctConstBits + idctPass1Bits + 3, out);
+    transpose8x8(out, rows);
+    for (uint k = 0; k < 8; k++)
+    {
+        _mm_store_si128((__m128i *)(component + k * 8), rows[k]);
+    }
+}
+#endif
+
+bool checkInverseDCT(const uint count)
 {
-    for (uint y = 0; y < header->mcuHeight; y += header->verticalSamplingFactor)
+    // a fixed seed, so a failure can be reproduced
+    std::mt19937 random(12345);
+    QuantizationTable qTable;
+    alignas(blockAlignment) int16_t coefficients[64];
+    alignas(blockAlignment) int16_t expected[64];
+    alignas(blockAlignment) int16_t actual[64];
+
+    // runs both transforms on the current coefficients and reports the first difference
+    auto compare = [&](const char *const name, const uint n, auto reference, auto tested)
     {
-        for (uint x = 0; x < header->mcuWidth; x += header->horizontalSamplingFactor)
+        std::memcpy(expected, coefficients, sizeof(coefficients));
+        std::memcpy(actual, coefficients, sizeof(coefficients));
+        reference(expected);
+        tested(actual);
+        for (uint i = 0; i < 64; i++)
+        {
+            if (expected[i] != actual[i])
+            {
+                std::cout << name << " IDCT mismatch in block " << n << " at " << i << ": " << actual[i] << " instead of " << expected[i] << "\n";
+                return false;
+            }
+        }
+        return true;
+    };
+
+    for (uint n = 0; n < count; n++)
+    {
+        // a new quantization table now and then, and coefficients that get rarer and smaller towards the high frequencies like in real images
+        if (n % 64 == 0)
+        {
+            const float scales[8] = {s0, s1, s2, s3, s4, s5, s6, s7};
+            for (uint i = 0; i < 64; i++)
+            {
+                qTable.table[i] = 1 + random() % (n % 128 == 0 ? 16 : 255);
+                qTable.prescaled[i] = qTable.table[i] * scales[i / 8];
+                qTable.table16[i] = qTable.table[i];
+            }
+        }
+        for (uint i = 0; i < 64; i++)
         {
-            for (uint i = 0; i < header->numComponents; ++i)
+            const int range = 2048 / qTable.table[zigZagMap[i]] >> (i / 16);
+            coefficients[zigZagMap[i]] = (random() % 4 == 0) ? (int)(random() % (2 * range + 1)) - range : 0;
+        }
+
+        // every so often a block no real image has: coefficients and quantizers anywhere in the int16 range,
+        // where the dequantized values have to saturate (only the integer transform promises anything for those)
+        if (n % 16 == 15)
+        {
+            QuantizationTable extreme;
+            for (uint i = 0; i < 64; i++)
             {
-                for (uint v = 0; v < header->colorComponents[i].verticalSamplingFactor; ++v)
-                {
-                    for (uint h = 0; h < header->colorComponents[i].horizontalSamplingFactor; ++h)
-                    {
-                        inverseDCTComponent(mcus[(y + v) * header->mcuWidthReal + (x + h)][i]);
-                    }
-                }
+                extreme.table16[i] = 1 + random() % 32767;
+                coefficients[i] = (int16_t)random();
             }
+            auto extremeInteger = [&extreme](int16_t *const block)
+            { inverseDCTComponentInteger(extreme, block); };
+#if defined(__SSE2__)
+            auto extremeIntegerSIMD = [&extreme](int16_t *const block)
+            { inverseDCTComponentIntegerSIMD(extreme, block); };
+            if (!compare("integer (saturated)", n, extremeInteger, extremeIntegerSIMD))
+            {
+                return false;
+            }
+#endif
+            continue;
+        }
+
+        auto integer = [&qTable](int16_t *const block)
+        { inverseDCTComponentInteger(qTable, block); };
+#if defined(__SSE2__) || defined(__AVX2__)
+        auto floatScalar = [&qTable](int16_t *const block)
+        { inverseDCTComponent(qTable.prescaled, block); };
+        auto floatSIMD = [&qTable](int16_t *const block)
+        { inverseDCTComponentSIMD(qTable.prescaled, block); };
+        if (!compare("float", n, floatScalar, floatSIMD))
+        {
+            return false;
+        }
+#endif
+#if defined(__SSE2__)
+        auto integerSIMD = [&qTable](int16_t *const block)
+        { inverseDCTComponentIntegerSIMD(qTable, block); };
+        if (!compare("integer", n, integer, integerSIMD))
+        {
+            return false;
+        }
+#endif
+
+        // and the shortcut for blocks that only have a DC coefficient
+        std::memset(coefficients + 1, 0, sizeof(coefficients) - sizeof(coefficients[0]));
+        auto integerDC = [&qTable](int16_t *const block)
+        { inverseDCTComponentIntegerDC(qTable, block); };
+        if (!compare("integer DC", n, integer, integerDC))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void inverseDCTBlock(const QuantizationTable &qTable, int16_t *const component, const byte lastNonZero, const IDCTMethod method, const uint size)
+{
+    const byte extent = zigZagExtent[lastNonZero];
+    if (size < 8)
+    {
+        // at 1/8 only the DC counts, whatever else the block holds
+        const bool dcOnly = extent == 1 || size == 1;
+        if (method == integerIDCT)
+        {
+            if (dcOnly)
+                inverseDCTComponentIntegerDC(qTable, component, size);
+            else
+                inverseDCTComponentIntegerScaled(qTable, component, size);
+        }
+        else
+        {
+            if (dcOnly)
+                inverseDCTComponentDC(qTable.prescaled, component, size);
+            else
+                inverseDCTComponentScaled(qTable, component, size);
+        }
+        return;
+    }
+
+    if (method == integerIDCT)
+    {
+        if (extent == 1)
+            inverseDCTComponentIntegerDC(qTable, component);
+        else
+#if defined(__SSE2__)
+            inverseDCTComponentIntegerSIMD(qTable, component);
+#else
+            inverseDCTComponentInteger(qTable, component);
+#endif
+        return;
+    }
+
+    if (extent == 1)
+        inverseDCTComponentDC(qTable.prescaled, component);
+    else if (extent == 2)
+        inverseDCTComponent2x2(qTable.prescaled, component);
+#if defined(__AVX2__)
+    // with eight lanes the full transform is already cheaper than the scalar 4x4 one
+    else
+        inverseDCTComponentSIMD(qTable.prescaled, component);
+#else
+    else if (extent <= 4)
+        inverseDCTComponent4x4(qTable.prescaled, component);
+#if defined(__SSE2__)
+    else
+        inverseDCTComponentSIMD(qTable.prescaled, component);
+#else
+    else
+        inverseDCTComponent(qTable.prescaled, component);
+#endif
+#endif
+}
+
+void inverseDCT(const Header *const header, BlockPlanes &planes)
+{
+    for (uint i = 0; i < planes.numComponents; ++i)
+    {
+        const QuantizationTable &qTable = header->quantizationTables[header->colorComponents[i].quantizationTableID];
+        const std::size_t count = (std::size_t)planes[i].blocksPerRow * planes[i].blockRows;
+        for (std::size_t block = 0; block < count; ++block)
+        {
+            inverseDCTBlock(qTable, planes[i].block(block), planes[i].lastNonZero[block], header->idctMethod, header->blockSize(i));
         }
     }
-}
\ No newline at end of file
+}
+
+#if defined(__clang__)
+#pragma clang fp contract(on)
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
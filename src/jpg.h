@@ -1,12 +1,30 @@
 #ifndef JPG_H
 #define JPG_H
+#include <iostream>
 #include <vector>
+#include <memory>
+#include <cstdint>
+#include <new>
+#include <atomic>
 #include <math.h>
 
 // this is just renaming stuff
 typedef unsigned char byte;
 typedef unsigned int uint;
 
+// where the messages about the file that is being decoded go (errors and printHeader)
+// this is std::cout, unless the batch decoder pointed the thread at the buffer of the file it is working on
+inline std::ostream *&consoleStream()
+{
+    thread_local std::ostream *stream = &std::cout;
+    return stream;
+}
+
+inline std::ostream &console()
+{
+    return *consoleStream();
+}
+
 // Start of Frame markers, non-differential, Huffman coding
 const byte SOF0 = 0xC0; // Baseline DCT
 const byte SOF1 = 0xC1; // Extended sequential DCT
@@ -103,6 +121,21 @@ struct QuantizationTable
 
     uint table[64] = {0}; // this is a 1D array instead of 2D because its more simpler
     bool set = false;     // whenw we populate a quant table we set this to true
+
+    // table[i] times the AAN scale factor of row i / 8, worked out once per DQT
+    // the first pass of the IDCT multiplies the quantized coefficients by this, which dequantizes them on the way
+    // aligned so the SIMD IDCT can load a whole row of it at once
+    alignas(32) float prescaled[64] = {0};
+
+    // table as 16 bit values for the integer IDCT (which only ever uses the low 16 bits of a dequantized coefficient)
+    alignas(32) int16_t table16[64] = {0};
+};
+
+// how the blocks are transformed back into samples
+enum IDCTMethod : byte
+{
+    floatIDCT,  // AAN in float (the default)
+    integerIDCT // fixed point (libjpeg's islow), gives the same output whatever the compiler, flags or SIMD support
 };
 
 struct ColorComponent
@@ -118,12 +151,33 @@ struct ColorComponent
     bool used = false; // keeps a check whether this color component is used in the img or not
 };
 
+// number of bits we peek at once when decoding a huffman symbol
+// codes of this length or shorter are resolved with a single table lookup
+const uint huffmanLookaheadBits = 9;
+
 struct HuffmanTable
 {
     byte offset[17] = {0}; // there are 16(len 1 to 16) groups, the next grp offset suggests the ending of the current and so we have one extra so that the last one can also have an ending
     byte symbols[162] = {0};
     uint codes[162] = {0}; // same as the size of the symbols array (but init with uint because codes can be longer than 8bits)
     bool set = false;
+    bool generated = false; // the codes and lookup tables below belong to the current offset and symbols, so generateCodes doesnt have to run again
+
+    // lookup tables filled by generateCodes
+    // indexed by the next huffmanLookaheadBits bits of the stream, a length of 0 means the code is longer than the lookahead
+    byte lookupLength[1 << huffmanLookaheadBits] = {0};
+    byte lookupSymbol[1 << huffmanLookaheadBits] = {0};
+
+    // canonical fallback for the longer codes
+    // maxCode[l] is the largest code of length l (-1 if there are none), valPtr[l] turns a code of length l into an index into symbols
+    int maxCode[17] = {0};
+    int valPtr[17] = {0};
+
+    // full decode table for AC tables, filled by generateACLookup
+    // when a code and its magnitude bits both fit in the lookahead the entry packs
+    // the total bit length (bits 0-7), the zero run (bits 8-15) and the sign extended coefficient (bits 16-31)
+    // an entry of 0 means the slow path has to be taken
+    int acLookup[1 << huffmanLookaheadBits] = {0};
 };
 
 struct Header
@@ -151,8 +205,16 @@ struct Header
 
     ColorComponent colorComponents[3];
 
-    // stores the huffman data
-    std::vector<byte> huffmanData;
+    // the huffman data, as it is in the file (still byte stuffed and with the restart markers), up to but not including EOI
+    // it points into the input, which BitReader reads in place
+    const byte *scanData = nullptr;
+    std::size_t scanSize = 0;
+
+    // keeps the memory scanData points into alive (the mapped file), empty when the caller owns the input
+    std::shared_ptr<const void> input;
+
+    // offset into scanData where each restart segment starts, right after its RSTn marker (the first one is always 0)
+    std::vector<std::size_t> restartOffsets;
 
     bool valid = true; // set to false when we encounter something illegal in the file
 
@@ -163,46 +225,208 @@ struct Header
 
     byte horizontalSamplingFactor = 1;
     byte verticalSamplingFactor = 1;
+
+    IDCTMethod idctMethod = floatIDCT; // set by whoever decodes the image, reset() leaves it as it is
+    byte scale = 1;                    // the image is decoded at 1/scale of its size (1, 2, 4 or 8), set and kept like idctMethod
+
+    // the samples every block turns into, and the size of the decoded image (partial pixels at the edges are kept)
+    uint blockSize() const
+    {
+        return 8 / scale;
+    }
+    // the same for the blocks of one component: blockSize() for the components with the most samples (luma),
+    // the subsampled ones cover more pixels per block so their blocks turn into more samples (at most 8), the way libjpeg does it
+    // with 4:2:0 at 1/2 size the chroma blocks are then transformed in full and dont have to be upsampled at all
+    // (the transforms are square, so with 4:2:2 the chroma is still upsampled across)
+    uint blockSize(const uint component) const
+    {
+        const uint h = horizontalSamplingFactor / colorComponents[component].horizontalSamplingFactor;
+        const uint v = verticalSamplingFactor / colorComponents[component].verticalSamplingFactor;
+        return std::min(8u, blockSize() * std::min(h, v));
+    }
+    uint outputWidth() const
+    {
+        return (width + scale - 1) / scale;
+    }
+    uint outputHeight() const
+    {
+        return (height + scale - 1) / scale;
+    }
+
+    // gets the header ready for the next image
+    // the tables are marked as not set, but their contents (and everything generated from them) stay, so an image that defines the same tables again doesnt have to redo that work
+    void reset()
+    {
+        for (QuantizationTable &table : quantizationTables)
+        {
+            table.set = false;
+        }
+        for (uint i = 0; i < 4; i++)
+        {
+            huffmanDCTables[i].set = false;
+            huffmanACTables[i].set = false;
+        }
+        frameType = 0;
+        height = 0;
+        width = 0;
+        numComponents = 0;
+        zeroBased = false;
+        startOfSelection = 0;
+        endOfSelection = 63;
+        successiveApproximationHigh = 0;
+        successiveApproximationLow = 0;
+        restartInterval = 0;
+        for (ColorComponent &component : colorComponents)
+        {
+            component = ColorComponent();
+        }
+        scanData = nullptr;
+        scanSize = 0;
+        input.reset();
+        restartOffsets.clear();
+        valid = true;
+        mcuHeight = 0;
+        mcuWidth = 0;
+        mcuHeightReal = 0;
+        mcuWidthReal = 0;
+        horizontalSamplingFactor = 1;
+        verticalSamplingFactor = 1;
+    }
+};
+
+// every block starts at a multiple of this, so the SIMD IDCT can use aligned loads and stores (a block is 128 bytes)
+const std::size_t blockAlignment = 32;
+
+// the 8x8 blocks of one color component, row after row of blocks
+// a component with sampling factors HxV has H blocks across and V blocks down in every MCU,
+// so with 2x2 luma sampling the chroma planes only hold a quarter as many blocks as the luma plane
+struct BlockPlane
+{
+    int16_t *blocks = nullptr;   // 64 values per block, coefficients at first and samples after the IDCT
+    byte *lastNonZero = nullptr; // zig-zag index of the last nonzero coefficient of each block (0 if only the DC is set), lets the IDCT skip the work for coefficients that are known to be 0
+    uint blocksPerRow = 0;
+    uint blockRows = 0;
+    std::size_t capacity = 0; // blocks there is memory for, can be more than blocksPerRow * blockRows when the planes are reused
+
+    std::size_t index(const uint row, const uint column) const
+    {
+        return (std::size_t)row * blocksPerRow + column;
+    }
+
+    int16_t *block(const std::size_t i) const
+    {
+        return blocks + i * 64;
+    }
 };
 
-struct MCU
+// the blocks of every color component, for the whole image or for a few rows of MCUs of it
+struct BlockPlanes
 {
-    // why use union? (to give same addr. in memory different names)
-    // sometimes a mcu might be representing rgb values instead of ycbcr
-    // thus union so that the same array can be called by 2 different names
-    union
+    BlockPlane components[3];
+    uint numComponents = 0;
+    uint mcusPerRow = 0;
+    uint mcuRows = 0;
+
+    BlockPlanes() = default;
+    BlockPlanes(const BlockPlanes &) = delete;
+    BlockPlanes &operator=(const BlockPlanes &) = delete;
+
+    ~BlockPlanes()
     {
-        int y[64] = {0};
-        int r[64];
-    };
-    union
+        for (BlockPlane &plane : components)
+        {
+            ::operator delete[](plane.blocks, std::align_val_t(blockAlignment));
+            delete[] plane.lastNonZero;
+        }
+    }
+
+    // makes room for rows x columns MCUs of the image described by header, returns false if there isnt enough memory
+    // memory from an earlier image is reused if it is big enough, so planes that are kept around stop allocating after the biggest image
+    bool allocate(const Header *const header, const uint columns, const uint rows)
     {
-        int cb[64] = {0};
-        int g[64];
-    };
-    union
+        numComponents = header->numComponents;
+        mcusPerRow = columns;
+        mcuRows = rows;
+        for (uint i = 0; i < numComponents; i++)
+        {
+            BlockPlane &plane = components[i];
+            plane.blocksPerRow = columns * header->colorComponents[i].horizontalSamplingFactor;
+            plane.blockRows = rows * header->colorComponents[i].verticalSamplingFactor;
+            const std::size_t count = (std::size_t)plane.blocksPerRow * plane.blockRows;
+            if (count <= plane.capacity)
+            {
+                continue;
+            }
+            ::operator delete[](plane.blocks, std::align_val_t(blockAlignment));
+            delete[] plane.lastNonZero;
+            plane.blocks = (int16_t *)::operator new[](count * 64 * sizeof(int16_t), std::align_val_t(blockAlignment), std::nothrow);
+            plane.lastNonZero = new (std::nothrow) byte[count]();
+            plane.capacity = (plane.blocks != nullptr && plane.lastNonZero != nullptr) ? count : 0;
+            if (plane.capacity == 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    BlockPlane &operator[](const uint i)
     {
-        int cr[64] = {0};
-        int b[64];
-    };
+        return components[i];
+    }
 
-    // we defined this since we wanted to access indiv components of the MCU in huffman_functions.cxx/decodeHuffmanTable function
-    int *operator[](uint i)
+    const BlockPlane &operator[](const uint i) const
     {
-        switch (i)
+        return components[i];
+    }
+};
+
+// buffers that are kept from one image to the next, so decoding a batch stops allocating (and page faulting fresh memory) once it has seen its biggest image
+struct DecodeArena
+{
+    BlockPlanes planes; // the coefficients of the whole image, or of the rows in flight
+
+    // bmps that have been handed out, each is free again once nobody else holds on to it (it has been written)
+    std::vector<std::shared_ptr<std::vector<byte>>> outputs;
+
+    // a free bmp buffer (still holding the memory of an earlier image), or a new one
+    std::shared_ptr<std::vector<byte>> output()
+    {
+        for (const std::shared_ptr<std::vector<byte>> &buffer : outputs)
         {
-        case 0:
-            return y;
-        case 1:
-            return cb;
-        case 2:
-            return cr;
-        default:
-            return nullptr;
+            if (buffer.use_count() == 1)
+            {
+                // whoever let go of it last is done with the memory
+                std::atomic_thread_fence(std::memory_order_acquire);
+                return buffer;
+            }
         }
+        outputs.push_back(std::make_shared<std::vector<byte>>());
+        return outputs.back();
     }
 };
 
+// components a probe reports the sampling factors of, enough for CMYK and YCCK
+const uint probeMaxComponents = 4;
+
+// what probeJPG finds out about an image without decoding it
+struct ProbeInfo
+{
+    bool valid = false; // false if no SOF marker could be found
+    byte frameType = 0;
+    uint height = 0;
+    uint width = 0;
+    byte numComponents = 0;
+    ColorComponent colorComponents[probeMaxComponents]; // only the sampling factors are filled in
+};
+
+// result of decoding a jpg from memory
+struct DecodedImage
+{
+    Header *header = nullptr; // nullptr if the data could not be read at all, otherwise owned by the caller
+    std::vector<byte> pixels; // header->outputWidth() * header->outputHeight() RGB triples, top row first (empty if decoding failed)
+};
+
 // IDCT scaling factors (S-Factors)
 const float m0 = 2.0 * std::cos(1.0 / 16.0 * 2.0 * M_PI);
 const float ml = 2.0 * std::cos(2.0 / 16.0 * 2.0 * M_PI);
@@ -220,6 +444,35 @@ const float s5 = std::cos(5.0 / 16.0 * M_PI) / 2.0;
 const float s6 = std::cos(6.0 / 16.0 * M_PI) / 2.0;
 const float s7 = std::cos(7.0 / 16.0 * M_PI) / 2.0;
 
+// constants of the integer IDCT, the products are scaled up by 2^idctConstBits and the first pass keeps idctPass1Bits extra bits
+const int idctConstBits = 13;
+const int idctPass1Bits = 2;
+const int fix0298631336 = 2446;  // 0.298631336 * 2^13, rounded
+const int fix0390180644 = 3196;  // 0.390180644
+const int fix0541196100 = 4433;  // 0.541196100
+const int fix0765366865 = 6270;  // 0.765366865
+const int fix0899976223 = 7373;  // 0.899976223
+const int fix1175875602 = 9633;  // 1.175875602
+const int fix1501321110 = 12299; // 1.501321110
+const int fix1847759065 = 15137; // 1.847759065
+const int fix1961570560 = 16069; // 1.961570560
+const int fix2053119869 = 16819; // 2.053119869
+const int fix2562915447 = 20995; // 2.562915447
+const int fix3072711026 = 25172; // 3.072711026
+
+// the 1-D transforms of the reduced IDCTs (decoding at 1/2 and 1/4 size), entry x * N + u weighs frequency u for output x
+// output x of N is the 8 point transform at the center of pixels 8x/N to 8(x+1)/N - 1, from the lowest N frequencies only
+const float reducedBasis4[16] = {s0, s2, s4, s6, s0, s6, -s4, -s2, s0, -s6, -s4, s2, s0, -s2, s4, -s6};
+const float reducedBasis2[4] = {s0, s4, s0, -s4};
+const int fix0191341716 = 1567; // 0.191341716
+const int fix0353553391 = 2896; // 0.353553391
+const int fix0461939766 = 3784; // 0.461939766
+const int reducedBasis4Fixed[16] = {fix0353553391, fix0461939766, fix0353553391, fix0191341716,
+                                    fix0353553391, fix0191341716, -fix0353553391, -fix0461939766,
+                                    fix0353553391, -fix0191341716, -fix0353553391, fix0461939766,
+                                    fix0353553391, -fix0461939766, fix0353553391, -fix0191341716};
+const int reducedBasis2Fixed[4] = {fix0353553391, fix0353553391, fix0353553391, -fix0353553391};
+
 const byte zigZagMap[] = {
     0, 1, 8, 16, 9, 2, 3, 10,
     17, 24, 32, 25, 18, 11, 4, 5,
@@ -230,4 +483,16 @@ const byte zigZagMap[] = {
     58, 59, 52, 45, 38, 31, 39, 46,
     53, 60, 61, 54, 47, 55, 62, 63};
 
+// if the last nonzero coefficient of a block is at zig-zag index i, every nonzero
+// coefficient lies within the top left zigZagExtent[i] x zigZagExtent[i] corner of the block
+const byte zigZagExtent[] = {
+    1, 2, 2, 3, 3, 3, 4, 4,
+    4, 4, 5, 5, 5, 5, 5, 6,
+    6, 6, 6, 6, 6, 7, 7, 7,
+    7, 7, 7, 7, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8};
+
 #endif
@@ -0,0 +1,111 @@
+#include <iostream>
+#include "jpg.h"
+
+// reads markers up to the first SOF and fills info from it, nothing after the SOF is looked at
+// unlike readJPG this prints nothing, so the results can be printed on their own
+bool probeJPG(const byte *const data, const std::size_t size, ProbeInfo &info);
+
+// same as above, only the pages of the file that hold the markers before the SOF are read from disk
+bool probeJPG(const std::string &filename, ProbeInfo &info);
+
+// prints one tab separated line: filename, width, height, number of components and sampling factors (HxV per component)
+// or the filename followed by "error" if the file couldnt be probed
+// with more than probeMaxComponents components the sampling factors are given as "unsupported"
+void printProbe(const std::string &filename, const ProbeInfo &info);
+
+// Definitions
+
+bool probeJPG(const byte *const data, const std::size_t size, ProbeInfo &info)
+{
+    info.valid = false;
+    ByteReader reader(data, size);
+    if (reader.get() != 0xFF || reader.get() != SOI)
+    {
+        return false;
+    }
+
+    while (reader)
+    {
+        byte current = reader.get();
+        if (current != 0xFF)
+        {
+            return false; // expected a marker
+        }
+        // any number of FF's are allowed before the marker
+        while (current == 0xFF && reader)
+        {
+            current = reader.get();
+        }
+
+        if (current >= SOF0 && current <= SOF15 && current != DHT && current != JPG && current != DAC)
+        {
+            info.frameType = current;
+            reader.skip(2); // length
+            reader.get();   // precision
+            info.height = (reader.get() << 8) + reader.get();
+            info.width = (reader.get() << 8) + reader.get();
+            info.numComponents = reader.get();
+            for (uint i = 0; i < info.numComponents && i < probeMaxComponents; i++)
+            {
+                reader.get(); // component ID
+                const byte samplingFactor = reader.get();
+                info.colorComponents[i].horizontalSamplingFactor = samplingFactor >> 4;
+                info.colorComponents[i].verticalSamplingFactor = samplingFactor & 0x0F;
+                reader.get(); // quantization table ID
+            }
+            info.valid = (bool)reader && info.width != 0 && info.height != 0 && info.numComponents != 0;
+            return info.valid;
+        }
+        if (current == SOI || current == EOI || current == SOS)
+        {
+            return false; // the SOF has to come before any of these
+        }
+        if (current == TEM || (current >= RST0 && current <= RST7))
+        {
+            continue; // no length
+        }
+
+        // every other marker is skipped without reading it
+        const uint length = (reader.get() << 8) + reader.get();
+        if (length < 2)
+        {
+            return false;
+        }
+        reader.skip(length - 2);
+    }
+    return false;
+}
+
+bool probeJPG(const std::string &filename, ProbeInfo &info)
+{
+    MappedFile file;
+    if (!file.open(filename, false))
+    {
+        info.valid = false;
+        return false;
+    }
+    return probeJPG(file.data(), file.size(), info);
+}
+
+void printProbe(const std::string &filename, const ProbeInfo &info)
+{
+    std::cout << filename << '\t';
+    if (!info.valid)
+    {
+        std::cout << "error\n";
+        return;
+    }
+    std::cout << info.width << '\t' << info.height << '\t' << (uint)info.numComponents << '\t';
+    if (info.numComponents > probeMaxComponents)
+    {
+        std::cout << "unsupported\n";
+        return;
+    }
+    for (uint i = 0; i < info.numComponents; i++)
+    {
+        if (i != 0)
+            std::cout << ',';
+        std::cout << (uint)info.colorComponents[i].horizontalSamplingFactor << 'x' << (uint)info.colorComponents[i].verticalSamplingFactor;
+    }
+    std::cout << '\n';
+}
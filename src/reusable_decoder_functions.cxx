@@ -0,0 +1,111 @@
+#include <iostream>
+#include <memory>
+#include "jpg.h"
+
+// decodes image after image and keeps everything that can be reused from one to the next:
+// the header (with the codes and lookup tables generated for its huffman tables), the coefficient planes and the bmp buffers
+// nothing is derived again unless the next image actually changes it, so the fixed cost of a small image is close to nothing
+// a Decoder is used by one thread at a time, every thread that decodes needs its own
+class Decoder;
+
+// Definitions
+
+class Decoder
+{
+private:
+    std::unique_ptr<Header> header; // created by the first read, reset by every read after that
+    DecodeArena arena;
+    IDCTMethod idctMethod = floatIDCT;
+    byte scale = 1;
+
+    // the header for the next image, nullptr if there isnt enough memory for one
+    Header *nextHeader()
+    {
+        if (header == nullptr)
+        {
+            header.reset(new (std::nothrow) Header);
+            if (header == nullptr)
+            {
+                console() << "ERROR: Memory error\n";
+            }
+        }
+        return header.get();
+    }
+
+public:
+    Decoder() = default;
+    Decoder(const Decoder &) = delete;
+    Decoder &operator=(const Decoder &) = delete;
+
+    // reads the markers of the next image, like readJPG
+    // nullptr if the file couldnt be opened or there wasnt enough memory, otherwise the header still has to be checked for valid
+    // the header belongs to the decoder and is overwritten by the next read
+    Header *read(const std::string &filename)
+    {
+        Header *const next = nextHeader();
+        if (next == nullptr || !readJPG(filename, next))
+        {
+            return nullptr;
+        }
+        next->idctMethod = idctMethod;
+        next->scale = scale;
+        return next;
+    }
+
+    // same as above for a jpg that is already in memory, the data has to stay alive until the image has been decoded
+    Header *read(const byte *const data, const std::size_t size)
+    {
+        Header *const next = nextHeader();
+        if (next == nullptr)
+        {
+            return nullptr;
+        }
+        readJPG(data, size, next);
+        next->idctMethod = idctMethod;
+        next->scale = scale;
+        return next;
+    }
+
+    // the inverse DCT used for the images read from now on
+    void setIDCTMethod(const IDCTMethod method)
+    {
+        idctMethod = method;
+    }
+
+    // the images read from now on are decoded at 1/scale of their size, scale has to be 1, 2, 4 or 8
+    // only the lowest frequencies of every block are transformed, so a thumbnail costs a fraction of the full decode
+    void setScale(const byte newScale)
+    {
+        scale = newScale;
+    }
+
+    // decodes the image that was read last into a bmp, see decodeFused
+    bool decodeBMP(std::vector<byte> &bmp, const uint numThreads = 0)
+    {
+        if (header == nullptr || header->valid == false)
+        {
+            return false;
+        }
+        return decodeFused(header.get(), bmp, numThreads, &arena);
+    }
+
+    // decodes the image that was read last into outputWidth() * outputHeight() RGB triples, top row first (like decodeJPG)
+    bool decodeRGB(std::vector<byte> &pixels, const uint numThreads = 0)
+    {
+        if (header == nullptr || header->valid == false || !decodeHuffmanData(header.get(), arena.planes, numThreads))
+        {
+            return false;
+        }
+        inverseDCT(header.get(), arena.planes);
+
+        pixels.resize((std::size_t)header->outputWidth() * header->outputHeight() * 3);
+        YCbCrToRGB(header.get(), arena.planes, pixels.data(), header->outputHeight());
+        return true;
+    }
+
+    // a buffer for decodeBMP, it is handed out again once whoever it was given to lets go of it
+    std::shared_ptr<std::vector<byte>> output()
+    {
+        return arena.output();
+    }
+};
@@ -0,0 +1,73 @@
+#include <iostream>
+#include <fstream>
+#include <functional>
+#include <cstdio>
+#include "jpg.h"
+
+// decodes the image one row of MCUs at a time, only that strip of pixels is ever in memory
+// sink gets every finished strip as BMP pixel rows (BGR, padded to 4 bytes, bottom row of the strip first)
+// topRow and rowCount tell which rows of the image the strip holds
+bool decodeStrips(Header *const header, const std::function<void(const byte *rows, uint topRow, uint rowCount)> &sink);
+
+// decodes the image into a BMP file strip by strip, so memory use only depends on the width of the image
+bool writeBMPStrips(Header *const header, const std::string &filename);
+
+// Definitions
+
+bool decodeStrips(Header *const header, const std::function<void(const byte *rows, uint topRow, uint rowCount)> &sink)
+{
+    generateHuffmanTables(header);
+
+    const uint mcusPerRow = header->mcuWidthReal / header->horizontalSamplingFactor;
+    const uint mcuRows = header->mcuHeightReal / header->verticalSamplingFactor;
+    const uint stripHeight = header->verticalSamplingFactor * header->blockSize();
+    const std::size_t rowSize = header->outputWidth() * 3 + header->outputWidth() % 4;
+    std::vector<byte> strip(rowSize * stripHeight); // padding bytes stay 0
+
+    BitReader b(header->scanData, header->scanSize);
+    int previousDCs[3] = {0};
+    for (uint mcuRow = 0; mcuRow < mcuRows; mcuRow++)
+    {
+        const uint topRow = mcuRow * stripHeight;
+        const uint rowCount = std::min(stripHeight, header->outputHeight() - topRow);
+        if (!decodeFusedRange(header, b, mcuRow * mcusPerRow, (mcuRow + 1) * mcusPerRow, previousDCs, strip.data(), topRow + rowCount - 1))
+        {
+            return false;
+        }
+        sink(strip.data(), topRow, rowCount);
+    }
+    return true;
+}
+
+bool writeBMPStrips(Header *const header, const std::string &filename)
+{
+    // open the output file
+    std::ofstream outFile = std::ofstream(filename, std::ios::out | std::ios::binary);
+    if (!outFile.is_open())
+    {
+        console() << "ERROR: Error opening output file\n";
+        return false;
+    }
+
+    // the header is written with the size of the whole file, then every strip goes straight to where it belongs
+    // (strips arrive top first, but BMP rows are stored bottom up)
+    std::vector<byte> bmpHeader;
+    putBMPHeader(bmpHeader, header->outputWidth(), header->outputHeight());
+    const std::size_t rowSize = header->outputWidth() * 3 + header->outputWidth() % 4;
+    outFile.write((const char *)bmpHeader.data(), bmpHeader.size());
+
+    auto sink = [&outFile, header, rowSize](const byte *rows, const uint topRow, const uint rowCount)
+    {
+        outFile.seekp(14 + 12 + (header->outputHeight() - topRow - rowCount) * rowSize);
+        outFile.write((const char *)rows, rowCount * rowSize);
+    };
+    if (!decodeStrips(header, sink))
+    {
+        // dont leave a half written file behind
+        outFile.close();
+        std::remove(filename.c_str());
+        return false;
+    }
+    outFile.close();
+    return true;
+}